@@ -0,0 +1,190 @@
+/**
+ * benchmark of CEFaceMask on a synthetic contact graph\n
+ * build: g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark\n
+ * usage: ./benchmark [contacts = 1000000] [seed = 1] [queries = 10000]\n
+ * persons are picked by a power law, a few hubs take part in a fixed share of contacts
+ * and times follow a day/night cycle over DAYS days, the same seed always generates the same graph
+ */
+#define __PROGTEST__
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <cassert>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <new>
+#include <random>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+using namespace std;
+
+#include "erouska.cpp"
+
+static const unsigned DAYS = 60; //length of the generated period
+static const unsigned HUBS = 8; //persons meeting much more people than the others
+static const double HUB_SHARE = 0.02; //share of contacts with a hub
+static const double EXPONENT = 1.2; //exponent of the power law of person degrees
+static const size_t BATCH = 1 << 20; //contacts generated and imported at once
+
+/**
+ * seeded generator of contacts, contacts come in time order of days, but not within a day
+ */
+class TGenerator {
+private:
+    mt19937_64 random;
+    size_t persons;
+    size_t total;
+    size_t generated = 0;
+    vector<double> hours; //cumulative weight of every hour of a day
+
+public:
+    TGenerator(uint64_t seed, size_t total) : random(seed), persons(max((size_t) 1000, total / 10)), total(total) {
+        //few contacts at night, peaks in the morning and in the afternoon
+        double sum = 0;
+        for (int hour = 0; hour < 24; hour++) {
+            sum += 0.1 + exp(-(hour - 8) * (hour - 8) / 8.0) + 1.5 * exp(-(hour - 17) * (hour - 17) / 12.0);
+            hours.push_back(sum);
+        }
+    }
+
+    /**
+     * @return id of a person with the given rank, lower ranks meet more people
+     */
+    static int id(size_t rank) { return 100000000 + (int) rank; }
+
+    /**
+     * @return rank of a person picked by the power law, ranks below HUBS are the hubs
+     */
+    size_t person() {
+        double u = uniform_real_distribution<double>(0, 1)(random);
+        if (u < HUB_SHARE) return random() % HUBS;
+        //inverse of the distribution function of a (continuous) power law over [1, persons]
+        double x = pow(1 - uniform_real_distribution<double>(0, 1)(random)
+                               * (1 - pow((double) persons, 1 - EXPONENT)), 1 / (1 - EXPONENT));
+        return min(persons - 1, HUBS + (size_t) x - 1);
+    }
+
+    size_t personCount() const { return persons; }
+
+    /**
+     * @return the next contact of the generated graph
+     */
+    CEFaceMask::TRecord next() {
+        unsigned day = (unsigned) (generated++ * DAYS / total);
+        double u = uniform_real_distribution<double>(0, hours.back())(random);
+        int hour = (int) (lower_bound(hours.begin(), hours.end(), u) - hours.begin());
+        static const int LENGTHS[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+        int month = 0;
+        while (day >= (unsigned) LENGTHS[month % 12]) day -= LENGTHS[month++ % 12];
+        size_t first = person(), second = person();
+        if (second == first) second = (first + 1) % persons;
+        return {2021 + month / 12, (uint8_t) (month % 12 + 1), (uint8_t) (day + 1), (uint8_t) hour,
+                (uint8_t) (random() % 60), (uint8_t) (random() % 60), {}, id(first), id(second)};
+    }
+};
+
+/**
+ * @return resident memory of the process in bytes
+ */
+static size_t residentMemory() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file) return 0;
+    size_t total = 0, resident = 0;
+    if (fscanf(file, "%zu %zu", &total, &resident) != 2) resident = 0;
+    fclose(file);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static double seconds(chrono::steady_clock::time_point since) {
+    return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+}
+
+/**
+ * runs a query for every id and prints its throughput and latency percentiles
+ * @param query called with an id, returns the number of listed contacts
+ */
+template<typename Query>
+static void measure(const char *name, const vector<int> &ids, Query query) {
+    vector<double> latencies;
+    size_t listed = 0;
+    auto start = chrono::steady_clock::now();
+    for (int id: ids) {
+        auto begin = chrono::steady_clock::now();
+        listed += query(id);
+        latencies.push_back(seconds(begin) * 1e6);
+    }
+    double total = seconds(start);
+    sort(latencies.begin(), latencies.end());
+    printf("%-28s %12.0f queries/s   p50 %9.2f us   p99 %9.2f us   %8.1f contacts/query\n", name,
+           ids.size() / total, latencies[latencies.size() / 2], latencies[latencies.size() * 99 / 100],
+           (double) listed / ids.size());
+}
+
+int main(int argc, char **argv) {
+    size_t contacts = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1;
+    size_t queries = argc > 3 ? strtoull(argv[3], nullptr, 10) : 10000;
+    if (!contacts || !queries) {
+        fprintf(stderr, "usage: %s [contacts] [seed] [queries]\n", argv[0]);
+        return 1;
+    }
+    TGenerator generator(seed, contacts);
+    CEFaceMask mask;
+    size_t memory = residentMemory();
+
+    //the first contacts are added one by one, the rest is imported in batches
+    size_t single = min(contacts, max((size_t) 1, contacts / 10));
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < single; i++) {
+        CEFaceMask::TRecord record = generator.next();
+        mask.addContact(CContact(CTimeStamp(record.year, record.month, record.day,
+                                            record.hour, record.minute, record.second), record.id1, record.id2));
+    }
+    double added = seconds(start);
+    vector<CEFaceMask::TRecord> batch;
+    double imported = 0;
+    for (size_t done = single; done < contacts; done += batch.size()) {
+        batch.clear();
+        while (batch.size() < BATCH && done + batch.size() < contacts) batch.push_back(generator.next());
+        start = chrono::steady_clock::now();
+        mask.importRecords(batch.data(), batch.size() * sizeof(CEFaceMask::TRecord));
+        imported += seconds(start);
+    }
+    batch = vector<CEFaceMask::TRecord>();
+    memory = residentMemory() - memory;
+
+    printf("contacts %zu, persons %zu, seed %llu\n", contacts, generator.personCount(), (unsigned long long) seed);
+    printf("%-28s %12.0f contacts/s\n", "addContact", single / added);
+    if (contacts > single) printf("%-28s %12.0f contacts/s\n", "importRecords", (contacts - single) / imported);
+    printf("%-28s %12.1f bytes/contact\n", "memory", (double) memory / contacts);
+
+    //queried persons follow the same power law as the contacts, so the hubs are queried too
+    vector<int> ids;
+    for (size_t i = 0; i < queries; i++) ids.push_back(TGenerator::id(generator.person()));
+    measure("listContacts", ids, [&mask](int id) { return mask.listContacts(id).size(); });
+    measure("listContacts (one day)", ids, [&mask](int id) {
+        return mask.listContacts(id, CTimeStamp(2021, 1, 15, 0, 0, 0), CTimeStamp(2021, 1, 15, 23, 59, 59)).size();
+    });
+    measure("listContacts (one hour)", ids, [&mask](int id) {
+        return mask.listContacts(id, CTimeStamp(2021, 1, 15, 17, 0, 0), CTimeStamp(2021, 1, 15, 17, 59, 59)).size();
+    });
+    return 0;
+}
@@ -1,7 +1,29 @@
 #ifndef __PROGTEST__
 #include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
 #include <cassert>
 #include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <new>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 #endif /* __PROGTEST__ */
 class CEFaceMask;
@@ -11,10 +33,30 @@ class CTimeStamp;
 class CTimeStamp {
 private:
     const int year, month, day, hour, minute, second;
+
+    static int64_t saturate(int value, int low, int high) {
+        return value < low ? low : value > high ? high : value;
+    }
 public:
     CTimeStamp(int year, int month, int day, int hour, int minute, int second)
             : year(year), month(month), day(day), hour(hour), minute(minute), second(second) {}
 
+    /**
+     * packs the time stamp into a single number that sorts the same way as the time stamps\n
+     * year takes the upper 24 bits (biased, so negative years sort first), every other field one byte,
+     * the time is not validated, a field out of range is saturated (year to 24 bits, the others to 0..255),
+     * so the keys of ordered time stamps are still ordered, but may be equal
+     * @return sortable 64-bit key
+     */
+    uint64_t key() const {
+        return (uint64_t) (saturate(year, -(1 << 23), (1 << 23) - 1) + (1 << 23)) << 40
+               | (uint64_t) saturate(month, 0, 0xFF) << 32
+               | (uint64_t) saturate(day, 0, 0xFF) << 24
+               | (uint64_t) saturate(hour, 0, 0xFF) << 16
+               | (uint64_t) saturate(minute, 0, 0xFF) << 8
+               | (uint64_t) saturate(second, 0, 0xFF);
+    }
+
     bool operator<=(const CTimeStamp &date2) const {
         if (year != date2.year) return year < date2.year;
         if (month != date2.month) return month < date2.month;
@@ -37,29 +79,1415 @@ public:
     friend CEFaceMask;
 };
 
+/**
+ * frees memory that concurrent readers may still be reading (epoch based reclamation)\n
+ * readers announce themselves in a counter picked by the current epoch,
+ * the single writer retires memory it has already unpublished and frees it
+ * once all readers that could have seen it have left
+ */
+class TReclaimer {
+private:
+    static const size_t RETIRED_LIMIT = 4096; //retired blocks kept before the writer waits for readers
+
+    atomic<uint64_t> epoch{0};
+    atomic<size_t> readers[2] = {{0}, {0}};
+    vector<function<void()>> retired;
+
+public:
+    ~TReclaimer() {
+        for (auto &release: retired) release();
+    }
+
+    /**
+     * marks the beginning of a read, never blocks
+     * @return epoch that has to be passed to leave()
+     */
+    uint64_t enter() {
+        while (true) {
+            uint64_t current = epoch.load();
+            readers[current & 1]++;
+            if (epoch.load() == current) return current;
+            readers[current & 1]--; //the writer moved on meanwhile, announce again
+        }
+    }
+
+    void leave(uint64_t entered) {
+        readers[entered & 1]--;
+    }
+
+    /**
+     * hands unpublished memory over to be freed when no reader can see it anymore, called by the writer
+     * @param release frees the memory
+     */
+    void retire(function<void()> release) {
+        retired.push_back(move(release));
+        if (retired.size() >= RETIRED_LIMIT) synchronize();
+    }
+
+    /**
+     * waits until readers of the current epoch leave and frees everything retired before, called by the writer
+     */
+    void synchronize() {
+        vector<function<void()>> releasing;
+        releasing.swap(retired);
+        uint64_t current = epoch.load();
+        epoch.store(current + 1);
+        while (readers[current & 1].load()) this_thread::yield();
+        for (auto &release: releasing) release();
+    }
+};
+
+/**
+ * keeps a reader announced for the lifetime of the guard
+ */
+class TReadGuard {
+private:
+    TReclaimer &reclaimer;
+    uint64_t entered;
+public:
+    explicit TReadGuard(TReclaimer &reclaimer) : reclaimer(reclaimer), entered(reclaimer.enter()) {}
+
+    ~TReadGuard() { reclaimer.leave(entered); }
+
+    TReadGuard(const TReadGuard &src) = delete;
+
+    TReadGuard &operator=(const TReadGuard &src) = delete;
+};
+
+/**
+ * threads shared by all parallel work of the process, started when they are first needed\n
+ * a job is split into parts that are taken by idle threads and by the thread that submitted it,
+ * so a job finishes even when all threads of the pool are busy with other jobs
+ */
+class TThreadPool {
+private:
+    struct TJob {
+        const function<void(size_t)> &task;
+        const size_t parts;
+        atomic<size_t> next{0}; //first part that was not taken yet
+        atomic<size_t> done{0}; //number of finished parts
+        size_t helpers = 0; //threads of the pool working on the job, guarded by the lock
+    };
+
+    mutex lock;
+    condition_variable work, finished;
+    deque<TJob *> jobs; //jobs with parts that may not be taken yet
+    vector<thread> threads;
+    bool stopping = false;
+
+    /**
+     * takes parts of a job until none is left
+     */
+    void help(TJob &job) {
+        for (size_t part; (part = job.next++) < job.parts;) {
+            job.task(part);
+            if (++job.done == job.parts) {
+                //the lock makes sure the submitter is either waiting already or checks the count later
+                { lock_guard<mutex> guard(lock); }
+                finished.notify_all();
+            }
+        }
+    }
+
+    void serve() {
+        unique_lock<mutex> guard(lock);
+        while (true) {
+            work.wait(guard, [this]() { return stopping || !jobs.empty(); });
+            if (stopping) return;
+            TJob *job = jobs.front();
+            if (job->next.load() >= job->parts) {
+                jobs.pop_front();
+                continue;
+            }
+            job->helpers++;
+            guard.unlock();
+            help(*job);
+            guard.lock();
+            if (!--job->helpers) finished.notify_all();
+        }
+    }
+
+public:
+    TThreadPool() = default;
+
+    ~TThreadPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        work.notify_all();
+        for (thread &worker: threads) worker.join();
+    }
+
+    TThreadPool(const TThreadPool &src) = delete;
+
+    TThreadPool &operator=(const TThreadPool &src) = delete;
+
+    /**
+     * @return pool of the process with a thread for every core but the calling one
+     */
+    static TThreadPool &shared() {
+        static TThreadPool pool;
+        return pool;
+    }
+
+    /**
+     * calls task(part) for every part in [0, parts) and waits until all of them finish
+     */
+    void run(size_t parts, const function<void(size_t)> &task) {
+        TJob job{task, parts};
+        {
+            lock_guard<mutex> guard(lock);
+            size_t wanted = min(parts, (size_t) max(1u, thread::hardware_concurrency())) - 1;
+            while (threads.size() < wanted) threads.emplace_back(&TThreadPool::serve, this);
+            jobs.push_back(&job);
+        }
+        work.notify_all();
+        help(job);
+        unique_lock<mutex> guard(lock);
+        auto queued = find(jobs.begin(), jobs.end(), &job);
+        if (queued != jobs.end()) jobs.erase(queued);
+        finished.wait(guard, [&job]() { return job.done.load() == job.parts && !job.helpers; });
+    }
+};
+
+/**
+ * append-only array written by one thread and read by many\n
+ * a full block is copied into a twice larger one and retired, readers holding the old block
+ * keep reading valid items, so they never have to wait for the writer
+ */
+template<typename T>
+class TSharedArray {
+private:
+    struct TBlock {
+        size_t capacity;
+        T *items;
+    };
+
+    atomic<TBlock *> block{nullptr};
+    atomic<size_t> count{0};
+
+    static void destroy(TBlock *old) {
+        if (!old) return;
+        ::operator delete(old->items);
+        delete old;
+    }
+
+public:
+    TSharedArray() = default;
+
+    ~TSharedArray() { destroy(block.load()); }
+
+    TSharedArray(const TSharedArray &src) = delete;
+
+    TSharedArray &operator=(const TSharedArray &src) = delete;
+
+    /**
+     * reads the published part of the array, safe to call concurrently with push()
+     * @param size filled with the number of published items
+     * @return published items
+     */
+    const T *read(size_t &size) const {
+        //the size has to be read first, the block read after it is at least as large
+        size = count.load(memory_order_acquire);
+        TBlock *current = block.load(memory_order_acquire);
+        return current ? current->items : nullptr;
+    }
+
+    /**
+     * appends an item and publishes it, called by the writer
+     * @param reclaimer receives the old block when the array grows
+     */
+    void push(const T &item, TReclaimer &reclaimer) {
+        static_assert(is_trivially_copyable<T>::value, "items are copied as raw memory");
+        size_t size = count.load(memory_order_relaxed);
+        TBlock *current = block.load(memory_order_relaxed);
+        if (!current || size == current->capacity) {
+            TBlock *grown = new TBlock{current ? current->capacity * 2 : 4, nullptr};
+            grown->items = (T *) ::operator new(grown->capacity * sizeof(T));
+            if (current) memcpy(grown->items, current->items, size * sizeof(T));
+            block.store(grown, memory_order_release);
+            if (current) reclaimer.retire([current]() { destroy(current); });
+            current = grown;
+        }
+        current->items[size] = item;
+        count.store(size + 1, memory_order_release);
+    }
+
+    /**
+     * resizes an array no reader can see yet, the items are left to the caller
+     * @param size number of items
+     * @param capacity reserved for items pushed later
+     * @return items to be filled
+     */
+    T *fill(size_t size, size_t capacity) {
+        TBlock *filled = new TBlock{max(max(size, capacity), (size_t) 4), nullptr};
+        filled->items = (T *) ::operator new(filled->capacity * sizeof(T));
+        destroy(block.exchange(filled));
+        count.store(size);
+        return filled->items;
+    }
+
+    /**
+     * fills an array no reader can see yet
+     */
+    void assign(const vector<T> &items) {
+        T *filled = fill(items.size(), 0);
+        if (!items.empty()) memcpy(filled, items.data(), items.size() * sizeof(T));
+    }
+
+    /**
+     * drops all items, no reader may be active
+     */
+    void clear() {
+        destroy(block.exchange(nullptr));
+        count.store(0);
+    }
+
+    /**
+     * @return number of items, meant for the writer
+     */
+    size_t size() const { return count.load(memory_order_relaxed); }
+
+    /**
+     * @return the last item, meant for the writer
+     */
+    const T &back() const { return block.load(memory_order_relaxed)->items[size() - 1]; }
+};
+
 class CEFaceMask {
 private:
-    vector<CContact> database;
+    /**
+     * a single contact seen from the side of one of the persons
+     */
+    struct TEdge {
+        uint64_t time; //packed time stamp of the contact
+        uint64_t contact; //position of the contact in the database
+        int other; //id of the other person
+    };
+
+    /**
+     * edges of a single person stored in one place, either in the index loaded from disk or in memory\n
+     * the edges keep the insertion order, their positions sorted by time find the edges in a window
+     * by a single binary search, edges added out of time order wait among a few late positions
+     */
+    struct TEdgeSpan {
+        const TEdge *edges;
+        size_t count;
+        const uint32_t *order; //positions of the edges sorted by time
+        size_t order_count;
+        const uint32_t *late; //positions of the edges missing in the order, in insertion order
+        size_t late_count;
+        uint64_t limit; //number of contacts visible to the reader, edges of later contacts are skipped
+    };
+
+    /**
+     * time order of the edges of a person, replaced as a whole once the late edges are sorted in
+     */
+    struct TTimeOrder {
+        TSharedArray<uint32_t> sorted;
+        TSharedArray<uint32_t> late;
+    };
+
+    /**
+     * edges of a single person in the order in which contacts were added\n
+     * written by the writer and read concurrently by queries\n
+     * an edge not older than the last sorted one is appended to the time order, an older one is late,
+     * the order is rebuilt once the late edges outnumber four times the square root of the sorted ones,
+     * so both the rebuilds and the scans of the late edges cost O(sqrt(n)) per edge
+     */
+    struct TPerson {
+        const int id;
+        TSharedArray<TEdge> edges;
+        atomic<TTimeOrder *> order{new TTimeOrder()};
+
+        explicit TPerson(int id) : id(id) {}
+
+        /**
+         * creates a person from edges that are kept after a compaction
+         */
+        TPerson(int id, const vector<TEdge> &kept) : id(id) {
+            vector<uint32_t> sorted(kept.size());
+            for (size_t i = 0; i < kept.size(); i++) sorted[i] = (uint32_t) i;
+            stable_sort(sorted.begin(), sorted.end(), [&kept](uint32_t first, uint32_t second) {
+                return kept[first].time < kept[second].time;
+            });
+            edges.assign(kept);
+            order.load()->sorted.assign(sorted);
+        }
+
+        ~TPerson() { delete order.load(); }
+
+        TPerson(const TPerson &src) = delete;
+
+        TPerson &operator=(const TPerson &src) = delete;
+
+        /**
+         * @return true if there are too many late edges and the order should be rebuilt, see reorder()
+         */
+        bool add(const TEdge &edge, TReclaimer &reclaimer) {
+            //the edge is published before its position, so readers reading the order first find every edge
+            uint32_t position = (uint32_t) edges.size();
+            edges.push(edge, reclaimer);
+            TTimeOrder *current = order.load(memory_order_relaxed);
+            size_t count;
+            const TEdge *items = edges.read(count);
+            if (!current->sorted.size() || items[current->sorted.back()].time <= edge.time) {
+                current->sorted.push(position, reclaimer);
+                return false;
+            }
+            current->late.push(position, reclaimer);
+            size_t late = current->late.size();
+            return late >= LATE_EDGES && late * late > 16 * current->sorted.size();
+        }
+
+        /**
+         * sorts the late edges into the time order and publishes the new order, called by the writer
+         */
+        void reorder(TReclaimer &reclaimer) {
+            TEdgeSpan current = span(UINT64_MAX);
+            auto earlier = [&current](uint32_t first, uint32_t second) {
+                return current.edges[first].time < current.edges[second].time;
+            };
+            vector<uint32_t> late(current.late, current.late + current.late_count);
+            stable_sort(late.begin(), late.end(), earlier);
+            //late edges are usually only a little late, the sorted positions before the earliest one are kept
+            const uint32_t *kept = upper_bound(current.order, current.order + current.order_count, late[0], earlier);
+            size_t total = current.order_count + late.size(), prefix = kept - current.order;
+            TTimeOrder *sorted = new TTimeOrder();
+            uint32_t *items = sorted->sorted.fill(total, 2 * total);
+            memcpy(items, current.order, prefix * sizeof(uint32_t));
+            merge(kept, current.order + current.order_count, late.begin(), late.end(), items + prefix, earlier);
+            TTimeOrder *previous = order.exchange(sorted);
+            reclaimer.retire([previous]() { delete previous; });
+        }
+
+        /**
+         * @param limit number of contacts visible to the reader
+         * @return published edges, edges of contacts the reader can not see yet are skipped by forEachEdge
+         */
+        TEdgeSpan span(uint64_t limit) const {
+            TEdgeSpan span;
+            //the order is read before the edges, so every position in it refers to a published edge
+            TTimeOrder *current = order.load(memory_order_acquire);
+            span.order = current->sorted.read(span.order_count);
+            span.late = current->late.read(span.late_count);
+            span.edges = edges.read(span.count);
+            span.limit = limit;
+            return span;
+        }
+    };
+
+    /**
+     * open addressing table of persons indexed since the checkpoint\n
+     * the writer replaces a person only when compacting him, a full table is copied into a larger one and retired
+     */
+    struct TPersonTable {
+        const size_t capacity; //power of two
+        atomic<TPerson *> *const slots;
+        size_t used = 0; //number of persons, used by the writer
+
+        explicit TPersonTable(size_t capacity) : capacity(capacity), slots(new atomic<TPerson *>[capacity]) {
+            for (size_t i = 0; i < capacity; i++) slots[i].store(nullptr, memory_order_relaxed);
+        }
+
+        ~TPersonTable() { delete[] slots; }
+
+        TPersonTable(const TPersonTable &src) = delete;
+
+        TPersonTable &operator=(const TPersonTable &src) = delete;
+
+        size_t start(int id) const {
+            return (size_t) ((uint32_t) id * 0x9E3779B97F4A7C15ull >> 32) & (capacity - 1);
+        }
+
+        /**
+         * @return the person or nullptr if he is not in the table
+         */
+        TPerson *find(int id) const {
+            for (size_t slot = start(id);; slot = (slot + 1) & (capacity - 1)) {
+                TPerson *person = slots[slot].load(memory_order_acquire);
+                if (!person || person->id == id) return person;
+            }
+        }
+
+        /**
+         * publishes a person that is not in the table yet, called by the writer
+         */
+        void insert(TPerson *person) {
+            size_t slot = start(person->id);
+            while (slots[slot].load(memory_order_relaxed)) slot = (slot + 1) & (capacity - 1);
+            slots[slot].store(person, memory_order_release);
+            used++;
+        }
+
+        /**
+         * publishes a new version of a person that is already in the table, called by the writer
+         */
+        void replace(TPerson *person) {
+            size_t slot = start(person->id);
+            while (slots[slot].load(memory_order_relaxed)->id != person->id) slot = (slot + 1) & (capacity - 1);
+            slots[slot].store(person, memory_order_release);
+        }
+    };
 
     /**
-     * @param array to check
-     * @param number to look for
-     * @return true if array contains number
+     * header of a segment file, followed by the time, id1 and id2 columns, each SEGMENT_CAPACITY long
      */
-    static bool contains(vector<int> &array, int number) {
-        return std::any_of(array.begin(), array.end(), [&number](int i){ return i == number; });
+    struct TSegmentHeader {
+        uint64_t magic;
+        uint64_t count; //number of contacts written to the segment
+        uint64_t latest; //newest time stamp in the segment
+        uint64_t horizon; //contacts older than this were expired when the segment was last written
+        uint64_t retention; //days kept by the retention policy, 0 keeps everything
+    };
+
+    /**
+     * block of contacts stored by columns\n
+     * the block is mapped either from a segment file or from anonymous memory
+     */
+    struct TSegment {
+        TSegmentHeader *header;
+        uint64_t *times;
+        int *ids1, *ids2;
+    };
+
+    /**
+     * header of an index file, followed by the persons, edges and order arrays
+     */
+    struct TIndexHeader {
+        uint64_t magic;
+        uint64_t contacts; //number of contacts covered by the index
+        uint64_t persons, edges;
+    };
+
+    /**
+     * entry of a person in an index file, persons are sorted by id\n
+     * edges of the person start at edge_begin in both the edges and the order array,
+     * the order holds their positions sorted by time, relative to the first edge of the person
+     */
+    struct TIndexPerson {
+        int64_t id;
+        uint64_t edge_begin, edge_count;
+    };
+
+    /**
+     * index loaded from the last checkpoint, it refers directly to the mapped file
+     */
+    struct TIndex {
+        void *memory = nullptr;
+        size_t size = 0;
+        uint64_t contacts = 0;
+        const TIndexPerson *persons = nullptr;
+        size_t person_count = 0;
+        const TEdge *edges = nullptr;
+        const uint32_t *order = nullptr;
+    };
+
+    /**
+     * index published to readers, checkpoint() replaces it as a whole
+     */
+    struct TState {
+        TIndex base; //index of the first base.contacts contacts, loaded from the last checkpoint
+        atomic<TPersonTable *> table; //index of contacts added after the checkpoint
+
+        TState() : table(new TPersonTable(16)) {}
+
+        ~TState() {
+            TPersonTable *persons = table.load();
+            for (size_t slot = 0; slot < persons->capacity; slot++) delete persons->slots[slot].load();
+            delete persons;
+            if (base.memory) munmap(base.memory, base.size);
+        }
+
+        TState(const TState &src) = delete;
+
+        TState &operator=(const TState &src) = delete;
+    };
+
+    /**
+     * consistent prefix of the database seen by a query, valid while the query holds a TReadGuard
+     */
+    struct TSnapshot {
+        size_t count; //number of contacts visible to the query
+        uint64_t horizon; //contacts older than this are expired
+        size_t first; //number of the first segment that was not dropped
+        const TState *state;
+        const TSegment *segments;
+    };
+
+    static const size_t PARALLEL_GRAIN = 256; //smallest amount of work worth giving to a thread
+    static const size_t COMPACT_STEP = 4; //persons checked for expired edges after every added contact
+    static const size_t LATE_EDGES = 16; //late edges of a person always kept before his order is rebuilt
+    static const size_t SEGMENT_CAPACITY = 1 << 20; //contacts in one segment
+    static const size_t SEGMENT_SIZE = sizeof(TSegmentHeader) + SEGMENT_CAPACITY * (sizeof(uint64_t) + 2 * sizeof(int));
+    static const uint64_t SEGMENT_MAGIC = 0x32304745534d4645; //"EFMSEG02"
+    static const uint64_t INDEX_MAGIC = 0x3230584449464645; //"EFFIDX02"
+
+    string directory; //empty if the database lives only in memory
+    TSharedArray<TSegment> segments; //contacts are stored by columns, so a scan reads only the columns it needs
+    atomic<size_t> count{0}; //number of contacts published to readers
+    atomic<uint64_t> horizon{0}; //contacts older than this are expired
+    atomic<size_t> first_segment{0}; //segments before it were dropped by the retention policy
+    atomic<TState *> state{new TState()};
+    mutable TReclaimer reclaimer;
+    unsigned retention = 0; //days kept by the retention policy, 0 keeps everything
+    uint64_t newest = 0; //newest time stamp in the database
+    size_t compact_cursor = 0; //slot of the person table checked next for expired edges
+    bool dirty = false; //contacts or the retention changed since the index was last written or loaded
+
+    /**
+     * takes a consistent prefix of the database, the caller has to hold a TReadGuard
+     */
+    TSnapshot snapshot() const {
+        TSnapshot view;
+        //the count has to be read first, the index and segments read after it cover at least as many contacts
+        view.count = count.load(memory_order_acquire);
+        view.horizon = horizon.load(memory_order_acquire);
+        view.first = first_segment.load(memory_order_acquire);
+        view.state = state.load(memory_order_acquire);
+        size_t mapped;
+        view.segments = segments.read(mapped);
+        return view;
+    }
+
+    /**
+     * maps a file into memory
+     * @param path of the file, anonymous memory is mapped if it is empty
+     * @param size of the mapping, a created file is extended to it
+     * @return address of the mapping or nullptr on error
+     */
+    static void *mapFile(const string &path, size_t size, bool create, bool writable) {
+        void *memory;
+        if (path.empty()) {
+            memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        } else {
+            int file = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | (create ? O_CREAT : 0), 0644);
+            if (file < 0) return nullptr;
+            if (create && ftruncate(file, size) != 0) {
+                close(file);
+                return nullptr;
+            }
+            memory = mmap(nullptr, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, file, 0);
+            close(file);
+        }
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    /**
+     * @param memory of a mapped segment
+     * @return segment with columns pointing into the memory
+     */
+    static TSegment segmentAt(void *memory) {
+        TSegment segment;
+        segment.header = (TSegmentHeader *) memory;
+        segment.times = (uint64_t *) (segment.header + 1);
+        segment.ids1 = (int *) (segment.times + SEGMENT_CAPACITY);
+        segment.ids2 = segment.ids1 + SEGMENT_CAPACITY;
+        return segment;
+    }
+
+    string segmentPath(size_t number) const {
+        char name[32];
+        snprintf(name, sizeof(name), "/segment-%06zu.bin", number);
+        return directory + name;
+    }
+
+    string indexPath() const {
+        return directory + "/index.bin";
+    }
+
+    /**
+     * creates a new empty segment at the end of the database
+     * @return false if the segment could not be mapped
+     */
+    bool addSegment() {
+        void *memory = mapFile(directory.empty() ? "" : segmentPath(segments.size()), SEGMENT_SIZE, true, true);
+        if (!memory) return false;
+        TSegment segment = segmentAt(memory);
+        segment.header->magic = SEGMENT_MAGIC;
+        segment.header->count = 0;
+        segment.header->latest = 0;
+        segment.header->horizon = horizon.load(memory_order_relaxed);
+        segment.header->retention = retention;
+        segments.push(segment, reclaimer);
+        return true;
+    }
+
+    /**
+     * checks every record of a mapped index, queries read them without any checks
+     * @return false if a person or an edge lies outside of the file or the order of a person is not his edges
+     *         sorted by time, as checkpoint() writes it
+     */
+    static bool validIndex(const TIndexHeader &header, const TIndex &index) {
+        for (size_t i = 0; i < index.person_count; i++) {
+            const TIndexPerson &person = index.persons[i];
+            //persons are found by a binary search over their ids
+            if (person.id < INT32_MIN || person.id > INT32_MAX || (i && person.id <= index.persons[i - 1].id)) {
+                return false;
+            }
+            if (person.edge_begin > header.edges || person.edge_count > header.edges - person.edge_begin
+                || person.edge_count > UINT32_MAX) {
+                return false;
+            }
+            const TEdge *edges = index.edges + person.edge_begin;
+            const uint32_t *order = index.order + person.edge_begin;
+            for (size_t position = 0; position < person.edge_count; position++) {
+                if (edges[position].contact >= header.contacts || order[position] >= person.edge_count) return false;
+                //ties are in insertion order, so the positions are distinct and the order holds every edge
+                if (position && (edges[order[position - 1]].time > edges[order[position]].time
+                                 || (edges[order[position - 1]].time == edges[order[position]].time
+                                     && order[position - 1] >= order[position]))) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    /**
+     * maps an index file written by checkpoint() and checks all of its records
+     * @param index filled with the mapped index, it is left unchanged on error
+     * @return false if the file is damaged or does not match the segments
+     */
+    bool loadIndex(TIndex &index) const {
+        struct stat info;
+        if (stat(indexPath().c_str(), &info) != 0) return true; //no checkpoint was made yet
+        if ((size_t) info.st_size < sizeof(TIndexHeader)) return false;
+        void *memory = mapFile(indexPath(), info.st_size, false, false);
+        if (!memory) return false;
+        const TIndexHeader *header = (const TIndexHeader *) memory;
+        size_t rest = info.st_size - sizeof(TIndexHeader);
+        //the counts are checked before they are multiplied, so the size can not overflow
+        bool valid = header->magic == INDEX_MAGIC && header->contacts <= count.load()
+                     && header->persons <= rest / sizeof(TIndexPerson)
+                     && header->edges <= rest / (sizeof(TEdge) + sizeof(uint32_t))
+                     && header->persons * sizeof(TIndexPerson) + header->edges * (sizeof(TEdge) + sizeof(uint32_t))
+                        == rest;
+        TIndex loaded;
+        loaded.memory = memory;
+        loaded.size = info.st_size;
+        loaded.contacts = header->contacts;
+        loaded.persons = (const TIndexPerson *) (header + 1);
+        loaded.person_count = header->persons;
+        loaded.edges = (const TEdge *) (loaded.persons + header->persons);
+        loaded.order = (const uint32_t *) (loaded.edges + header->edges);
+        if (!valid || !validIndex(*header, loaded)) {
+            munmap(memory, info.st_size);
+            return false;
+        }
+        index = loaded;
+        return true;
+    }
+
+    /**
+     * unmaps all files and empties the database, no query may be running
+     */
+    void release() {
+        size_t mapped;
+        const TSegment *stored = segments.read(mapped);
+        for (size_t i = first_segment.load(); i < mapped; i++) munmap(stored[i].header, SEGMENT_SIZE);
+        segments.clear();
+        delete state.exchange(new TState());
+        reclaimer.synchronize();
+        count = 0;
+        horizon = 0;
+        first_segment = 0;
+        newest = 0;
+        compact_cursor = 0;
+        dirty = false;
+        directory.clear();
+    }
+
+    /**
+     * finds a person indexed since the checkpoint or adds him, called by the writer
+     */
+    TPerson &person(int id) {
+        TState *current = state.load(memory_order_relaxed);
+        TPersonTable *table = current->table.load(memory_order_relaxed);
+        TPerson *found = table->find(id);
+        if (found) return *found;
+        if (2 * (table->used + 1) > table->capacity) {
+            //persons whose edges all expired are left out, so the table can even shrink
+            vector<TPerson *> live, empty;
+            for (size_t slot = 0; slot < table->capacity; slot++) {
+                TPerson *moved = table->slots[slot].load(memory_order_relaxed);
+                if (moved) (moved->edges.size() ? live : empty).push_back(moved);
+            }
+            size_t capacity = 16;
+            while (capacity < 4 * (live.size() + 1)) capacity *= 2;
+            TPersonTable *grown = new TPersonTable(capacity);
+            for (TPerson *moved: live) grown->insert(moved);
+            current->table.store(grown, memory_order_release);
+            reclaimer.retire([table]() { delete table; });
+            for (TPerson *dropped: empty) reclaimer.retire([dropped]() { delete dropped; });
+            table = grown;
+        }
+        found = new TPerson(id);
+        table->insert(found);
+        return *found;
+    }
+
+    /**
+     * @return number of days since 1970-01-01 of a date in the proleptic gregorian calendar
+     */
+    static int64_t daysFromCivil(int64_t year, unsigned month, unsigned day) {
+        year -= month <= 2;
+        int64_t era = (year >= 0 ? year : year - 399) / 400;
+        unsigned yoe = (unsigned) (year - era * 400);
+        unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+        unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+        return era * 146097 + (int64_t) doe - 719468;
+    }
+
+    /**
+     * @param key packed time stamp, see CTimeStamp::key()
+     * @param days subtracted from the date, the time of day is kept
+     * @return packed time stamp the given number of days earlier
+     */
+    static uint64_t daysBefore(uint64_t key, unsigned days) {
+        int64_t year = (int64_t) (key >> 40) - (1 << 23);
+        int64_t shifted = daysFromCivil(year, (key >> 32) & 0xFF, (key >> 24) & 0xFF) - days + 719468;
+        int64_t era = (shifted >= 0 ? shifted : shifted - 146096) / 146097;
+        unsigned doe = (unsigned) (shifted - era * 146097);
+        unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+        unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+        unsigned mp = (5 * doy + 2) / 153;
+        unsigned day = doy - (153 * mp + 2) / 5 + 1;
+        unsigned month = mp < 10 ? mp + 3 : mp - 9;
+        year = yoe + era * 400 + (month <= 2);
+        return CTimeStamp((int) year, (int) month, (int) day, 0, 0, 0).key() | (key & 0xFFFFFF);
+    }
+
+    /**
+     * moves the horizon after the newest contact or the retention changed and drops expired segments,
+     * called by the writer\n
+     * a segment is dropped as a whole once its newest contact expires, queries still reading it
+     * keep it mapped until they leave
+     */
+    void expire() {
+        if (retention && newest) {
+            uint64_t moved = daysBefore(newest, retention);
+            if (moved > horizon.load(memory_order_relaxed)) horizon.store(moved, memory_order_release);
+        }
+        if (segments.size()) {
+            TSegmentHeader *active = segments.back().header;
+            active->horizon = horizon.load(memory_order_relaxed);
+            active->retention = retention;
+        }
+        size_t mapped;
+        const TSegment *stored = segments.read(mapped);
+        size_t first = first_segment.load(memory_order_relaxed);
+        //the last segment is never dropped, new contacts are written to it
+        for (; first + 1 < mapped && stored[first].header->latest < horizon.load(memory_order_relaxed); first++) {
+            first_segment.store(first + 1, memory_order_release);
+            if (!directory.empty()) remove(segmentPath(first).c_str());
+            void *memory = stored[first].header;
+            reclaimer.retire([memory]() { munmap(memory, SEGMENT_SIZE); });
+        }
+    }
+
+    /**
+     * drops expired edges of the next few persons in memory, called by the writer after added contacts\n
+     * the expired edges of a person are the first ones in his time order and maybe a few late ones,
+     * a person is copied only when at least half of his edges expired, so every edge is copied O(1) times,
+     * expired edges elsewhere are skipped by queries and dropped by the next checkpoint
+     * @param added number of contacts added, an import checks as many persons as adding them one by one would
+     */
+    void compact(size_t added = 1) {
+        TPersonTable *table = state.load(memory_order_relaxed)->table.load(memory_order_relaxed);
+        uint64_t limit = horizon.load(memory_order_relaxed);
+        //one pass over the table checks every person
+        size_t steps = added > table->capacity / COMPACT_STEP ? table->capacity : added * COMPACT_STEP;
+        for (size_t step = 0; step < steps; step++) {
+            compact_cursor = (compact_cursor + 1) & (table->capacity - 1);
+            TPerson *person = table->slots[compact_cursor].load(memory_order_relaxed);
+            if (!person) continue;
+            TEdgeSpan span = person->span(UINT64_MAX);
+            size_t expired = lower_bound(span.order, span.order + span.order_count, limit,
+                                         [&span](uint32_t position, uint64_t time) {
+                                             return span.edges[position].time < time;
+                                         }) - span.order;
+            for (size_t i = 0; i < span.late_count; i++) expired += span.edges[span.late[i]].time < limit;
+            if (!expired || 2 * expired < span.count) continue;
+            vector<TEdge> kept;
+            forEachEdge(span, limit, UINT64_MAX, [&kept](const TEdge &edge) { kept.push_back(edge); });
+            table->replace(new TPerson(person->id, kept));
+            reclaimer.retire([person]() { delete person; });
+        }
+    }
+
+    /**
+     * adds a stored contact to the index, called by the writer
+     */
+    void index(uint64_t position, uint64_t time, int id1, int id2) {
+        //a contact of a person with himself is never listed and an expired one is never returned
+        if (id1 != id2 && horizon.load(memory_order_relaxed) <= time) {
+            TPerson &first = person(id1);
+            if (first.add({time, position, id2}, reclaimer)) first.reorder(reclaimer);
+            TPerson &second = person(id2);
+            if (second.add({time, position, id1}, reclaimer)) second.reorder(reclaimer);
+        }
+    }
+
+    /**
+     * @param view of the database
+     * @param id of a person
+     * @param spans filled with edges of the person, first from the loaded index, then from memory
+     * @return number of filled spans
+     */
+    static size_t find(const TSnapshot &view, int id, TEdgeSpan spans[2]) {
+        size_t found = 0;
+        const TIndex &base = view.state->base;
+        const TIndexPerson *last = base.persons + base.person_count;
+        const TIndexPerson *stored = lower_bound(base.persons, last, id,
+                                                 [](const TIndexPerson &person, int id) { return person.id < id; });
+        if (stored != last && stored->id == id) {
+            spans[found++] = {base.edges + stored->edge_begin, stored->edge_count,
+                              base.order + stored->edge_begin, stored->edge_count, nullptr, 0, view.count};
+        }
+        const TPerson *person = view.state->table.load(memory_order_acquire)->find(id);
+        if (person) spans[found++] = person->span(view.count);
+        return found;
+    }
+
+    /**
+     * calls visit for every edge in a span with time in \<from,to\>, in insertion order\n
+     * the time order is searched once, only the positions of the matching edges are sorted back,
+     * if all edges match, they are visited straight away
+     * @param span of edges that are visited
+     * @param from packed begin of the interval
+     * @param to packed end of the interval
+     * @param visit called with every matching edge
+     */
+    template<typename Visitor>
+    static void forEachEdge(const TEdgeSpan &span, uint64_t from, uint64_t to, Visitor visit) {
+        const uint32_t *first = lower_bound(span.order, span.order + span.order_count, from,
+                                            [&span](uint32_t position, uint64_t time) {
+                                                return span.edges[position].time < time;
+                                            });
+        const uint32_t *last = upper_bound(first, span.order + span.order_count, to,
+                                           [&span](uint64_t time, uint32_t position) {
+                                               return time < span.edges[position].time;
+                                           });
+        auto matches = [&span, from, to](uint32_t position) {
+            return from <= span.edges[position].time && span.edges[position].time <= to;
+        };
+        size_t matching = (last - first) + count_if(span.late, span.late + span.late_count, matches);
+        if (matching == span.count) {
+            for (size_t i = 0; i < span.count && span.edges[i].contact < span.limit; i++) visit(span.edges[i]);
+            return;
+        }
+        vector<uint32_t> positions(first, last);
+        copy_if(span.late, span.late + span.late_count, back_inserter(positions), matches);
+        sort(positions.begin(), positions.end());
+        for (uint32_t position: positions) {
+            if (span.edges[position].contact >= span.limit) break;
+            visit(span.edges[position]);
+        }
+    }
+
+    /**
+     * calls visit for every edge of a person with time in \<from,to\>, in insertion order, skips expired edges
+     */
+    template<typename Visitor>
+    static void forEachContact(const TSnapshot &view, int id, uint64_t from, uint64_t to, Visitor visit) {
+        from = max(from, view.horizon);
+        TEdgeSpan spans[2];
+        size_t found = find(view, id, spans);
+        //edges of the loaded index were all added before the edges in memory
+        for (size_t i = 0; i < found; i++) forEachEdge(spans[i], from, to, visit);
+    }
+
+    /**
+     * @param id of a person
+     * @param from packed begin of the interval
+     * @param to packed end of the interval
+     * @return list of unique id's the person was in contact with in interval \<from,to\>
+     */
+    static vector<int> collect(const TSnapshot &view, int id, uint64_t from, uint64_t to) {
+        vector<int> results;
+        unordered_set<int> seen;
+        forEachContact(view, id, from, to, [&](const TEdge &edge) {
+            if (seen.insert(edge.other).second) results.push_back(edge.other);
+        });
+        return results;
+    }
+
+    /**
+     * finds rows in [from, to) where exactly one of the ids is the wanted one\n
+     * compares 8 (AVX2) or 4 (SSE2) rows at once, the rest is compared one by one
+     * @param visit called with the position of every matching row, in order
+     */
+    template<typename Visitor>
+    static void scanRows(const int *ids1, const int *ids2, size_t from, size_t to, int id, Visitor visit) {
+        size_t row = from;
+#if defined(__AVX2__)
+        const __m256i wanted = _mm256_set1_epi32(id);
+        for (; row + 8 <= to; row += 8) {
+            __m256i first = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (ids1 + row)), wanted);
+            __m256i second = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (ids2 + row)), wanted);
+            unsigned mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_xor_si256(first, second)));
+            for (; mask; mask &= mask - 1) visit(row + __builtin_ctz(mask));
+        }
+#elif defined(__SSE2__)
+        const __m128i wanted = _mm_set1_epi32(id);
+        for (; row + 4 <= to; row += 4) {
+            __m128i first = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (ids1 + row)), wanted);
+            __m128i second = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (ids2 + row)), wanted);
+            unsigned mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_xor_si128(first, second)));
+            for (; mask; mask &= mask - 1) visit(row + __builtin_ctz(mask));
+        }
+#endif
+        for (; row < to; row++) {
+            if ((ids1[row] == id) != (ids2[row] == id)) visit(row);
+        }
+    }
+
+    /**
+     * lists contacts of a person by scanning the whole database instead of using the index\n
+     * every thread scans its own part of the segments, the parts are merged in order
+     * @param view of the database
+     * @param id of a person
+     * @param from packed begin of the interval
+     * @param to packed end of the interval
+     * @return list of unique id's in insertion order
+     */
+    static vector<int> scan(const TSnapshot &view, int id, uint64_t from, uint64_t to) {
+        //comparing a row is much cheaper than a query, so a thread gets PARALLEL_GRAIN times more rows
+        size_t kept = min(view.first * SEGMENT_CAPACITY, view.count); //rows before it were dropped
+        size_t parts = workers((view.count - kept) / PARALLEL_GRAIN);
+        vector<vector<int>> found(parts);
+        from = max(from, view.horizon);
+        parallelFor(view.count - kept, parts, [&](size_t part, size_t first, size_t last) {
+            first += kept;
+            last += kept;
+            unordered_set<int> seen;
+            for (size_t number = first / SEGMENT_CAPACITY; number * SEGMENT_CAPACITY < last; number++) {
+                const TSegment &segment = view.segments[number];
+                size_t start = number * SEGMENT_CAPACITY;
+                size_t rows_from = max(first, start) - start, rows_to = min(last, start + SEGMENT_CAPACITY) - start;
+                scanRows(segment.ids1, segment.ids2, rows_from, rows_to, id, [&](size_t row) {
+                    if (segment.times[row] < from || to < segment.times[row]) return;
+                    int other = segment.ids1[row] == id ? segment.ids2[row] : segment.ids1[row];
+                    if (seen.insert(other).second) found[part].push_back(other);
+                });
+            }
+        });
+        vector<int> results;
+        unordered_set<int> seen;
+        for (const vector<int> &part: found) {
+            for (int other: part) {
+                if (seen.insert(other).second) results.push_back(other);
+            }
+        }
+        return results;
+    }
+
+    /**
+     * @param count amount of work
+     * @return number of threads the work should be split to
+     */
+    static size_t workers(size_t count) {
+        size_t cores = max(1u, thread::hardware_concurrency());
+        return max((size_t) 1, min(cores, count / PARALLEL_GRAIN));
+    }
+
+    /**
+     * splits [0, count) into contiguous parts and processes them by the threads of the shared pool,
+     * a single part is processed by the calling thread alone
+     * @param count amount of work
+     * @param parts number of parts, see workers()
+     * @param task called as task(part, from, to)
+     */
+    template<typename Task>
+    static void parallelFor(size_t count, size_t parts, Task task) {
+        if (parts <= 1) {
+            task(0, 0, count);
+            return;
+        }
+        TThreadPool::shared().run(parts, [&](size_t part) {
+            task(part, count * part / parts, count * (part + 1) / parts);
+        });
+    }
+
+    /**
+     * contacts parsed from one chunk of a feed, stored by columns like the segments
+     */
+    struct TBatch {
+        vector<uint64_t> times;
+        vector<int> ids1, ids2;
+    };
+
+    /**
+     * reads a decimal number and the character after it
+     * @param position moved after the separator
+     * @param separator expected after the number
+     * @return false if the number is missing, out of \<low,high\> or not followed by the separator
+     */
+    static bool parseNumber(const char *&position, const char *end, int64_t low, int64_t high, char separator,
+                            int64_t &value) {
+        bool negative = position != end && *position == '-' && low < 0;
+        if (negative) position++;
+        const char *digits = position;
+        value = 0;
+        for (; position != end && *position >= '0' && *position <= '9' && position - digits < 12; position++) {
+            value = value * 10 + (*position - '0');
+        }
+        if (negative) value = -value;
+        if (position == digits || value < low || high < value) return false;
+        if (separator == '\n') {
+            if (position != end && *position == '\r') position++;
+            return position == end || *position++ == '\n';
+        }
+        return position != end && *position++ == separator;
+    }
+
+    /**
+     * parses lines "year-month-day hour:minute:second,id1,id2" of a CSV feed, empty lines are skipped
+     * @param batch receives the parsed contacts
+     * @return false if a line has a wrong format
+     */
+    static bool parseLines(const char *position, const char *end, TBatch &batch) {
+        while (position != end) {
+            if (*position == '\n' || *position == '\r') {
+                position++;
+                continue;
+            }
+            int64_t year, month, day, hour, minute, second, id1, id2;
+            if (!parseNumber(position, end, -(1 << 23), (1 << 23) - 1, '-', year)
+                || !parseNumber(position, end, 0, 255, '-', month) || !parseNumber(position, end, 0, 255, ' ', day)
+                || !parseNumber(position, end, 0, 255, ':', hour) || !parseNumber(position, end, 0, 255, ':', minute)
+                || !parseNumber(position, end, 0, 255, ',', second)
+                || !parseNumber(position, end, INT32_MIN, INT32_MAX, ',', id1)
+                || !parseNumber(position, end, INT32_MIN, INT32_MAX, '\n', id2)) {
+                return false;
+            }
+            batch.times.push_back(CTimeStamp(year, month, day, hour, minute, second).key());
+            batch.ids1.push_back(id1);
+            batch.ids2.push_back(id2);
+        }
+        return true;
+    }
+
+    /**
+     * makes sure the segments have room for contacts added after the published ones, called by the writer
+     * @param added number of contacts
+     * @return segments, valid until the next call
+     */
+    const TSegment *reserve(size_t added) {
+        while (segments.size() * SEGMENT_CAPACITY < count.load(memory_order_relaxed) + added) {
+            if (!addSegment()) throw bad_alloc();
+        }
+        size_t mapped;
+        return segments.read(mapped);
+    }
+
+    /**
+     * writes a contact to its row without publishing it
+     */
+    static void store(const TSegment *columns, size_t position, uint64_t time, int id1, int id2) {
+        const TSegment &segment = columns[position / SEGMENT_CAPACITY];
+        size_t row = position % SEGMENT_CAPACITY;
+        segment.times[row] = time;
+        segment.ids1[row] = id1;
+        segment.ids2[row] = id2;
+    }
+
+    /**
+     * indexes contacts written after the published ones and publishes them all at once, called by the writer
+     * @param added number of written contacts
+     */
+    void publish(size_t added) {
+        size_t mapped;
+        const TSegment *columns = segments.read(mapped);
+        size_t first = count.load(memory_order_relaxed);
+        uint64_t latest = newest;
+        for (size_t position = first; position < first + added; position++) {
+            const TSegment &segment = columns[position / SEGMENT_CAPACITY];
+            size_t row = position % SEGMENT_CAPACITY;
+            uint64_t time = segment.times[row];
+            segment.header->count = row + 1;
+            segment.header->latest = max(segment.header->latest, time);
+            latest = max(latest, time);
+            index(position, time, segment.ids1[row], segment.ids2[row]);
+        }
+        count.store(first + added, memory_order_release);
+        if (added) dirty = true;
+        if (latest > newest) {
+            newest = latest;
+            if (retention) expire();
+        }
     }
 
 public:
 
+    /**
+     * contact in a binary feed, see importRecords()
+     */
+    struct TRecord {
+        int32_t year;
+        uint8_t month, day, hour, minute, second, unused[3];
+        int32_t id1, id2;
+    };
+
+    CEFaceMask() {}
+
+    /**
+     * a persistent database writes its index to disk before it is closed, unless it did not change since then
+     */
+    ~CEFaceMask() {
+        checkpoint();
+        release();
+        delete state.load();
+    }
+
+    CEFaceMask(const CEFaceMask &src) = delete;
+
+    CEFaceMask &operator=(const CEFaceMask &src) = delete;
+
+    /**
+     * makes an empty database persistent, stored in segment files in a directory\n
+     * existing segments are mapped without being read and the last checkpoint of the index is mapped and checked,
+     * only contacts added after the checkpoint are indexed again, the stored retention replaces the current one\n
+     * if the index is damaged or does not match the segments, all contacts are indexed again from the segments
+     * @param path of an existing directory
+     * @return false if the database is not empty or the segments could not be opened
+     */
+    bool open(const string &path) {
+        if (count.load() || !directory.empty()) return false;
+        release();
+        directory = path;
+        //segments dropped by the retention policy are missing at the beginning
+        size_t first = SIZE_MAX;
+        if (DIR *listing = opendir(path.c_str())) {
+            while (dirent *entry = readdir(listing)) {
+                size_t number;
+                char rest;
+                if (sscanf(entry->d_name, "segment-%zu.bin%c", &number, &rest) == 1) first = min(first, number);
+            }
+            closedir(listing);
+        }
+        if (first == SIZE_MAX) first = 0;
+        for (size_t number = 0; number < first; number++) segments.push(TSegment(), reclaimer);
+        first_segment.store(first);
+        size_t stored = first * SEGMENT_CAPACITY;
+        struct stat info;
+        for (size_t number = first; stat(segmentPath(number).c_str(), &info) == 0; number++) {
+            void *memory = (size_t) info.st_size == SEGMENT_SIZE
+                           ? mapFile(segmentPath(number), SEGMENT_SIZE, false, true) : nullptr;
+            if (!memory) {
+                release();
+                return false;
+            }
+            segments.push(segmentAt(memory), reclaimer);
+            //only the last segment can be partially filled
+            const TSegmentHeader *header = segments.back().header;
+            if (header->magic != SEGMENT_MAGIC || header->count > SEGMENT_CAPACITY
+                || stored != number * SEGMENT_CAPACITY) {
+                release();
+                return false;
+            }
+            stored += header->count;
+            newest = max(newest, header->latest);
+            retention = header->retention;
+            horizon.store(header->horizon);
+        }
+        count.store(stored);
+        TState *current = state.load();
+        //a damaged index is left out and rebuilt from the segments, the next checkpoint replaces it
+        dirty = !loadIndex(current->base) || current->base.contacts < stored;
+        size_t mapped;
+        const TSegment *columns = segments.read(mapped);
+        for (size_t position = max(current->base.contacts, first * SEGMENT_CAPACITY); position < stored; position++) {
+            const TSegment &segment = columns[position / SEGMENT_CAPACITY];
+            size_t row = position % SEGMENT_CAPACITY;
+            index(position, segment.times[row], segment.ids1[row], segment.ids2[row]);
+        }
+        return true;
+    }
+
+    /**
+     * flushes the segments and writes the whole index to the directory,
+     * so the next open() does not have to rebuild it\n
+     * the new index file replaces the old one atomically, queries running meanwhile are not blocked,
+     * nothing is written if no contact was added and the retention did not change since the last checkpoint
+     * @return false if the database is not persistent or the index could not be written
+     */
+    bool checkpoint() {
+        if (directory.empty()) return false;
+        if (!dirty) return true;
+        TSnapshot view = snapshot();
+        for (size_t number = view.first; number * SEGMENT_CAPACITY < view.count; number++) {
+            if (msync(view.segments[number].header, SEGMENT_SIZE, MS_SYNC) != 0) return false;
+        }
+
+        //persons of the loaded index and of the memory, sorted by id
+        const TIndex &base = view.state->base;
+        const TPersonTable *table = view.state->table.load();
+        vector<int> ids;
+        for (size_t i = 0; i < base.person_count; i++) ids.push_back((int) base.persons[i].id);
+        size_t loaded = ids.size();
+        for (size_t slot = 0; slot < table->capacity; slot++) {
+            const TPerson *person = table->slots[slot].load();
+            if (person) ids.push_back(person->id);
+        }
+        sort(ids.begin() + loaded, ids.end());
+        inplace_merge(ids.begin(), ids.begin() + loaded, ids.end());
+        ids.erase(unique(ids.begin(), ids.end()), ids.end());
+
+        //expired edges are left out, the kept edges of every person are sorted by time again
+        TIndexHeader header = {INDEX_MAGIC, view.count, 0, 0};
+        vector<TIndexPerson> persons;
+        for (int id: ids) {
+            TIndexPerson person = {id, header.edges, 0};
+            forEachContact(view, id, 0, UINT64_MAX, [&person](const TEdge &) { person.edge_count++; });
+            if (!person.edge_count) continue;
+            header.edges += person.edge_count;
+            persons.push_back(person);
+        }
+        header.persons = persons.size();
+
+        string temporary = indexPath() + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) return false;
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1
+                       && fwrite(persons.data(), sizeof(TIndexPerson), persons.size(), file) == persons.size();
+        //the padding after the id of the other person is written as zeros, not as whatever the memory held
+        TEdge stored;
+        memset(&stored, 0, sizeof(stored));
+        for (size_t i = 0; written && i < persons.size(); i++) {
+            forEachContact(view, (int) persons[i].id, 0, UINT64_MAX, [&](const TEdge &edge) {
+                stored.time = edge.time;
+                stored.contact = edge.contact;
+                stored.other = edge.other;
+                written = written && fwrite(&stored, sizeof(TEdge), 1, file) == 1;
+            });
+        }
+        vector<uint64_t> times;
+        vector<uint32_t> order;
+        for (size_t i = 0; written && i < persons.size(); i++) {
+            times.clear();
+            forEachContact(view, (int) persons[i].id, 0, UINT64_MAX, [&times](const TEdge &edge) {
+                times.push_back(edge.time);
+            });
+            order.resize(times.size());
+            for (size_t position = 0; position < order.size(); position++) order[position] = (uint32_t) position;
+            stable_sort(order.begin(), order.end(), [&times](uint32_t first, uint32_t second) {
+                return times[first] < times[second];
+            });
+            written = fwrite(order.data(), sizeof(uint32_t), order.size(), file) == order.size();
+        }
+        written = fflush(file) == 0 && fsync(fileno(file)) == 0 && written;
+        if (fclose(file) != 0 || !written || rename(temporary.c_str(), indexPath().c_str()) != 0) {
+            remove(temporary.c_str());
+            return false;
+        }
+
+        //readers switch to the new index at once, the old one is freed when the last of them leaves
+        TState *next = new TState();
+        if (!loadIndex(next->base)) {
+            delete next;
+            return false;
+        }
+        TState *previous = state.exchange(next);
+        reclaimer.retire([previous]() { delete previous; });
+        reclaimer.synchronize();
+        dirty = false;
+        return true;
+    }
+
     /**
      * adds a new contact to the database\n
-     * does not check input and duplicates
+     * does not check input and duplicates, a persistent database writes it straight to the mapped segment\n
+     * only one thread may add contacts (or call open and checkpoint), queries can run concurrently
+     * and see every contact once this method returns
      * @param contact to be added
      * @return reference to object
      */
     CEFaceMask &addContact(CContact contact) {
-        database.push_back(contact);
+        store(reserve(1), count.load(memory_order_relaxed), contact.time.key(), contact.id1, contact.id2);
+        publish(1);
+        if (retention) compact();
+        return *this;
+    }
+
+    /**
+     * adds all contacts of a CSV feed, one "year-month-day hour:minute:second,id1,id2" per line\n
+     * line aligned chunks of the feed are parsed and copied to the segments in parallel,
+     * then the contacts are indexed in one pass and published at once, in the order of the lines
+     * @param data of the feed
+     * @param size of the feed in bytes
+     * @return false if a line has a wrong format, then no contact is added
+     */
+    bool importCSV(const char *data, size_t size) {
+        //the end of a chunk is moved after the end of its line, the next chunk starts there
+        auto align = [data, size](size_t offset) {
+            if (!offset || offset >= size) return min(offset, size);
+            const char *line = (const char *) memchr(data + offset - 1, '\n', size - offset + 1);
+            return line ? (size_t) (line - data) + 1 : size;
+        };
+        //a line has at least 16 characters, so a chunk of PARALLEL_GRAIN bytes is a few lines
+        size_t parts = workers(size / 16);
+        vector<TBatch> batches(parts);
+        vector<char> parsed(parts);
+        parallelFor(size, parts, [&](size_t part, size_t from, size_t to) {
+            parsed[part] = parseLines(data + align(from), data + align(to), batches[part]);
+        });
+        if (!all_of(parsed.begin(), parsed.end(), [](char ok) { return ok; })) return false;
+
+        vector<size_t> offsets(parts + 1, count.load(memory_order_relaxed));
+        for (size_t part = 0; part < parts; part++) offsets[part + 1] = offsets[part] + batches[part].times.size();
+        const TSegment *columns = reserve(offsets[parts] - offsets[0]);
+        parallelFor(parts, parts, [&](size_t part, size_t, size_t) {
+            const TBatch &batch = batches[part];
+            for (size_t i = 0; i < batch.times.size(); i++) {
+                store(columns, offsets[part] + i, batch.times[i], batch.ids1[i], batch.ids2[i]);
+            }
+        });
+        publish(offsets[parts] - offsets[0]);
+        if (retention) compact(offsets[parts] - offsets[0]);
+        return true;
+    }
+
+    /**
+     * adds all contacts of a binary feed of TRecord structures in the byte order of the machine\n
+     * the records are converted straight to the segments in parallel,
+     * then they are indexed in one pass and published at once, in the order of the feed
+     * @param data of the feed, does not have to be aligned
+     * @param size of the feed in bytes
+     * @return false if the size is not a multiple of the record size, then no contact is added
+     */
+    bool importRecords(const void *data, size_t size) {
+        if (size % sizeof(TRecord)) return false;
+        size_t added = size / sizeof(TRecord), first = count.load(memory_order_relaxed);
+        const TSegment *columns = reserve(added);
+        parallelFor(added, workers(added), [&](size_t, size_t from, size_t to) {
+            for (size_t i = from; i < to; i++) {
+                TRecord record;
+                memcpy(&record, (const char *) data + i * sizeof(TRecord), sizeof(TRecord));
+                uint64_t time = CTimeStamp(record.year, record.month, record.day,
+                                           record.hour, record.minute, record.second).key();
+                store(columns, first + i, time, record.id1, record.id2);
+            }
+        });
+        publish(added);
+        if (retention) compact(added);
+        return true;
+    }
+
+    /**
+     * keeps only contacts from the last days before the newest contact (sliding window)\n
+     * expired contacts are never listed again, whole segments are dropped once all their contacts expire
+     * and persons are compacted a few at a time while contacts are added, so no call has to stop the database\n
+     * the window only slides forward, a longer retention (or 0) does not bring back expired contacts
+     * @param days of contacts kept before the newest one, 0 keeps everything
+     * @return reference to object
+     */
+    CEFaceMask &setRetention(unsigned days) {
+        if (days != retention) dirty = true;
+        retention = days;
+        expire();
         return *this;
     }
 
@@ -68,14 +1496,8 @@ public:
      * @return list of unique id's the person was in contact with
      */
     vector<int> listContacts(int id) const {
-        vector<int> results;
-        for (auto contact: database) {
-            if (contact.id1 == id xor contact.id2 == id) {
-                int new_infected = contact.id1 == id ? contact.id2 : contact.id1;
-                if (!contains(results, new_infected)) results.push_back(new_infected);
-            }
-        }
-        return results;
+        TReadGuard guard(reclaimer);
+        return collect(snapshot(), id, 0, UINT64_MAX);
     }
 
     /**
@@ -83,14 +1505,112 @@ public:
      * @return list of unique id's the person was in contact with in interval \<begin,end\>
      */
     vector<int> listContacts(int id, CTimeStamp begin, CTimeStamp end) const {
+        TReadGuard guard(reclaimer);
+        return collect(snapshot(), id, begin.key(), end.key());
+    }
+
+    /**
+     * same as listContacts(id), but scans the whole database without using the index\n
+     * meant for ad-hoc queries and for checking the index
+     * @param id of a person
+     * @return list of unique id's the person was in contact with
+     */
+    vector<int> scanContacts(int id) const {
+        TReadGuard guard(reclaimer);
+        return scan(snapshot(), id, 0, UINT64_MAX);
+    }
+
+    /**
+     * same as listContacts(id, begin, end), but scans the whole database without using the index
+     * @param id of a person
+     * @return list of unique id's the person was in contact with in interval \<begin,end\>
+     */
+    vector<int> scanContacts(int id, CTimeStamp begin, CTimeStamp end) const {
+        TReadGuard guard(reclaimer);
+        return scan(snapshot(), id, begin.key(), end.key());
+    }
+
+    /**
+     * lists contacts of many persons at once, the queries are split between threads
+     * @param ids of persons
+     * @return list of contacts for every id, same as listContacts(id)
+     */
+    vector<vector<int>> listContacts(const vector<int> &ids) const {
+        TReadGuard guard(reclaimer);
+        TSnapshot view = snapshot();
+        vector<vector<int>> results(ids.size());
+        parallelFor(ids.size(), workers(ids.size()), [&](size_t, size_t from, size_t to) {
+            for (size_t i = from; i < to; i++) results[i] = collect(view, ids[i], 0, UINT64_MAX);
+        });
+        return results;
+    }
+
+    /**
+     * lists contacts of many persons in interval \<begin,end\> at once, the queries are split between threads
+     * @param ids of persons
+     * @return list of contacts for every id, same as listContacts(id, begin, end)
+     */
+    vector<vector<int>> listContacts(const vector<int> &ids, CTimeStamp begin, CTimeStamp end) const {
+        TReadGuard guard(reclaimer);
+        TSnapshot view = snapshot();
+        vector<vector<int>> results(ids.size());
+        parallelFor(ids.size(), workers(ids.size()), [&](size_t, size_t from, size_t to) {
+            for (size_t i = from; i < to; i++) results[i] = collect(view, ids[i], begin.key(), end.key());
+        });
+        return results;
+    }
+
+    /**
+     * finds everyone who could have been infected by a person through a chain of contacts\n
+     * every contact of the chain happens in interval \<begin,end\> and not sooner than the previous one,
+     * the frontier of every hop is expanded in parallel
+     * @param id of a person
+     * @param hops maximal length of a chain
+     * @return list of unique id's ordered by the hop they were first reached in,
+     *         then by the order in which contacts were added
+     */
+    vector<int> traceContacts(int id, CTimeStamp begin, CTimeStamp end, unsigned hops) const {
+        typedef pair<int, uint64_t> TArrival; //person and the earliest time he could have been infected
+        TReadGuard guard(reclaimer);
+        TSnapshot view = snapshot();
         vector<int> results;
-        for (auto contact: database) {
-            if (contact.id1 == id xor contact.id2 == id) {
-                if (begin <= contact.time && contact.time <= end) {
-                    int new_infected = contact.id1 == id ? contact.id2 : contact.id1;
-                    if (!contains(results, new_infected)) results.push_back(new_infected);
+        unordered_map<int, uint64_t> earliest{{id, begin.key()}};
+        vector<TArrival> frontier{{id, begin.key()}};
+        uint64_t to = end.key();
+
+        for (unsigned hop = 0; hop < hops && !frontier.empty(); hop++) {
+            //every thread expands its own part of the frontier into its own list of candidates
+            size_t parts = workers(frontier.size());
+            vector<vector<TArrival>> candidates(parts);
+            parallelFor(frontier.size(), parts, [&](size_t part, size_t from, size_t until) {
+                for (size_t i = from; i < until; i++) {
+                    forEachContact(view, frontier[i].first, frontier[i].second, to, [&](const TEdge &edge) {
+                        candidates[part].emplace_back(edge.other, edge.time);
+                    });
+                }
+            });
+
+            //merging the parts in order keeps the result independent of the number of threads
+            unordered_map<int, size_t> queued; //position of a person in the next frontier
+            vector<TArrival> next;
+            for (const vector<TArrival> &part: candidates) {
+                for (const TArrival &candidate: part) {
+                    auto known = earliest.find(candidate.first);
+                    if (known == earliest.end()) {
+                        earliest.emplace(candidate);
+                        results.push_back(candidate.first);
+                    } else if (candidate.second < known->second) {
+                        //an earlier infection can spread further, the person has to be expanded again
+                        known->second = candidate.second;
+                    } else continue;
+                    auto position = queued.find(candidate.first);
+                    if (position == queued.end()) {
+                        queued.emplace(candidate.first, next.size());
+                        next.push_back(candidate);
+                    } else next[position->second].second = candidate.second;
                 }
             }
+            frontier.swap(next);
         }
         return results;
     }
@@ -99,6 +1619,12 @@ public:
 #ifndef __PROGTEST__
 
 int main() {
+    //fields out of range are not validated, but they still compare as numbers
+    assert (CTimeStamp(2021, 1, 1, 0, 0, -1) <= CTimeStamp(2021, 1, 1, 0, 0, 0));
+    assert (!(CTimeStamp(2021, 1, 1, 0, 0, 300) <= CTimeStamp(2021, 1, 1, 0, 0, 59)));
+    assert (CTimeStamp(2021, 1, 1, 0, 0, -1).key() <= CTimeStamp(2021, 1, 1, 0, 0, 0).key());
+    assert (CTimeStamp(2021, 1, 1, 0, 0, 59).key() < CTimeStamp(2021, 1, 1, 0, 0, 300).key());
+
     CEFaceMask test;
 
     test.addContact(CContact(CTimeStamp(2021, 1, 10, 12, 40, 10), 123456789, 999888777))
@@ -117,6 +1643,117 @@ int main() {
             (vector<int>{999888777, 111222333}));
     assert (test.listContacts(123456789, CTimeStamp(2021, 1, 10, 12, 41, 9), CTimeStamp(2021, 2, 21, 17, 59, 59)) ==
             (vector<int>{111222333}));
+    assert (test.scanContacts(123456789) == test.listContacts(123456789));
+    assert (test.scanContacts(191919191) == (vector<int>{}));
+    assert (test.scanContacts(123456789, CTimeStamp(2021, 1, 5, 18, 0, 1), CTimeStamp(2021, 2, 21, 17, 59, 59)) ==
+            (vector<int>{999888777, 111222333}));
+    assert (test.listContacts(vector<int>{123456789, 191919191, 999888777}) ==
+            (vector<vector<int>>{{999888777, 111222333, 456456456}, {}, {123456789, 555000222}}));
+    assert (test.listContacts(vector<int>{123456789, 999888777},
+                              CTimeStamp(2021, 1, 10, 12, 41, 9), CTimeStamp(2021, 2, 21, 17, 59, 59)) ==
+            (vector<vector<int>>{{111222333}, {555000222}}));
+    assert (test.traceContacts(123456789, CTimeStamp(2021, 1, 1, 0, 0, 0), CTimeStamp(2021, 12, 31, 0, 0, 0), 1) ==
+            (vector<int>{999888777, 111222333, 456456456}));
+    assert (test.traceContacts(123456789, CTimeStamp(2021, 1, 1, 0, 0, 0), CTimeStamp(2021, 12, 31, 0, 0, 0), 2) ==
+            (vector<int>{999888777, 111222333, 456456456, 555000222}));
+    assert (test.traceContacts(123456789, CTimeStamp(2021, 2, 6, 0, 0, 0), CTimeStamp(2021, 12, 31, 0, 0, 0), 2) ==
+            (vector<int>{999888777}));
+    assert (test.traceContacts(555000222, CTimeStamp(2021, 1, 1, 0, 0, 0), CTimeStamp(2021, 12, 31, 0, 0, 0), 3) ==
+            (vector<int>{999888777, 123456789}));
+    assert (test.traceContacts(191919191, CTimeStamp(2021, 1, 1, 0, 0, 0), CTimeStamp(2021, 12, 31, 0, 0, 0), 3) ==
+            (vector<int>{}));
+
+    CEFaceMask shared;
+    thread writer([&shared]() {
+        for (int i = 0; i < 10000; i++) {
+            shared.addContact(CContact(CTimeStamp(2021, 3, 1 + i % 28, 12, 0, 0), 100 + i % 7, 200 + i % 1000));
+        }
+    });
+    for (vector<int> seen; seen.size() < 1000;) {
+        //a query sees a prefix of the log, so every answer extends the previous one
+        vector<int> current = shared.listContacts(103);
+        assert (current.size() >= seen.size() && equal(seen.begin(), seen.end(), current.begin()));
+        seen = current;
+    }
+    writer.join();
+
+    CEFaceMask imported;
+    const char feed[] = "2021-1-10 12:40:10,123456789,999888777\n"
+                        "2021-1-12 12:40:10,123456789,111222333\r\n"
+                        "\n"
+                        "2021-2-5 15:30:28,999888777,555000222";
+    assert (!imported.importCSV(feed, sizeof(feed) - 10));
+    assert (imported.importCSV(feed, sizeof(feed) - 1));
+    CEFaceMask::TRecord records[] = {{2021, 2, 21, 18, 0, 0, {}, 123456789, 999888777},
+                                     {2021, 1, 5, 18, 0, 0, {}, 123456789, 456456456}};
+    assert (!imported.importRecords(records, sizeof(records) - 1));
+    assert (imported.importRecords(records, sizeof(records)));
+    assert (imported.listContacts(123456789) == (vector<int>{999888777, 111222333, 456456456}));
+    assert (imported.listContacts(999888777) == (vector<int>{123456789, 555000222}));
+    assert (imported.listContacts(123456789, CTimeStamp(2021, 1, 5, 18, 0, 1), CTimeStamp(2021, 2, 21, 17, 59, 59)) ==
+            (vector<int>{999888777, 111222333}));
+
+    CEFaceMask window;
+    window.setRetention(7)
+            .addContact(CContact(CTimeStamp(2021, 2, 25, 12, 0, 0), 123456789, 999888777))
+            .addContact(CContact(CTimeStamp(2021, 3, 1, 12, 0, 0), 123456789, 111222333))
+            .addContact(CContact(CTimeStamp(2021, 3, 4, 12, 0, 0), 123456789, 456456456));
+    assert (window.listContacts(123456789) == (vector<int>{999888777, 111222333, 456456456}));
+    window.addContact(CContact(CTimeStamp(2021, 3, 4, 12, 0, 1), 999888777, 555000222));
+    assert (window.listContacts(123456789) == (vector<int>{111222333, 456456456}));
+    assert (window.listContacts(999888777) == (vector<int>{555000222}));
+    assert (window.scanContacts(123456789) == (vector<int>{111222333, 456456456}));
+    assert (window.listContacts(123456789, CTimeStamp(2021, 1, 1, 0, 0, 0), CTimeStamp(2021, 12, 31, 0, 0, 0)) ==
+            (vector<int>{111222333, 456456456}));
+
+    char directory[] = "/tmp/erouska-XXXXXX";
+    assert (mkdtemp(directory));
+    {
+        CEFaceMask stored;
+        assert (stored.open(directory));
+        assert (!stored.open(directory));
+        stored.addContact(CContact(CTimeStamp(2021, 1, 10, 12, 40, 10), 123456789, 999888777))
+                .addContact(CContact(CTimeStamp(2021, 1, 12, 12, 40, 10), 123456789, 111222333));
+        assert (stored.checkpoint());
+        stored.addContact(CContact(CTimeStamp(2021, 2, 5, 15, 30, 28), 999888777, 555000222));
+    }
+    {
+        CEFaceMask stored;
+        assert (stored.open(directory));
+        assert (stored.listContacts(999888777) == (vector<int>{123456789, 555000222}));
+        stored.addContact(CContact(CTimeStamp(2021, 1, 5, 18, 0, 0), 123456789, 456456456));
+        assert (stored.listContacts(123456789) == (vector<int>{999888777, 111222333, 456456456}));
+    }
+    //a second link to the index shows whether the file is replaced
+    assert (link((string(directory) + "/index.bin").c_str(), (string(directory) + "/index.old").c_str()) == 0);
+    {
+        CEFaceMask stored;
+        assert (stored.open(directory));
+        assert (stored.listContacts(123456789) == (vector<int>{999888777, 111222333, 456456456}));
+        assert (stored.listContacts(123456789, CTimeStamp(2021, 1, 5, 18, 0, 1), CTimeStamp(2021, 2, 21, 17, 59, 59)) ==
+                (vector<int>{999888777, 111222333}));
+        assert (stored.scanContacts(999888777) == (vector<int>{123456789, 555000222}));
+        assert (stored.checkpoint());
+    }
+    //nothing changed, so the index was not written again
+    struct stat kept;
+    assert (stat((string(directory) + "/index.bin").c_str(), &kept) == 0 && kept.st_nlink == 2);
+    assert (remove((string(directory) + "/index.old").c_str()) == 0);
+    {
+        //the edges of the first person point past the end of the index, it is rebuilt from the segments
+        FILE *index = fopen((string(directory) + "/index.bin").c_str(), "r+b");
+        uint64_t edges = UINT64_MAX;
+        assert (index && fseek(index, 4 * sizeof(uint64_t) + 2 * sizeof(uint64_t), SEEK_SET) == 0
+                && fwrite(&edges, sizeof(edges), 1, index) == 1 && fclose(index) == 0);
+        CEFaceMask stored;
+        assert (stored.open(directory));
+        assert (stored.listContacts(123456789) == (vector<int>{999888777, 111222333, 456456456}));
+        assert (stored.listContacts(999888777) == (vector<int>{123456789, 555000222}));
+        assert (stored.listContacts(111222333) == (vector<int>{123456789}));
+    }
+    assert (remove((string(directory) + "/segment-000000.bin").c_str()) == 0);
+    assert (remove((string(directory) + "/index.bin").c_str()) == 0);
+    assert (rmdir(directory) == 0);
     return 0;
 }
 
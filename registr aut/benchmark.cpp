@@ -0,0 +1,241 @@
+/**
+ * benchmark of CRegister on synthetic registers and workload mixes\n
+ * build: g++ -std=c++17 -O2 -pthread benchmark.cpp -o benchmark\n
+ * usage: ./benchmark [cars = 1000000] [seed = 1] [operations = 100000] [exponent = 1.2] [plates = random]\n
+ * owners are picked by a power law with the given exponent (0 picks them uniformly), so a few owners
+ * have many cars, plates are either issued in order ("sequential") or spread over the whole range ("random"),
+ * the same seed always generates the same register and the same operations
+ */
+#define __PROGTEST__
+#include <string>
+#include <vector>
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <random>
+#include <chrono>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+using namespace std;
+
+#include "registr.cpp"
+
+static const size_t BATCH = 1 << 16; //cars added by one Apply() while the register is built
+static const size_t PLATES = (size_t) 26 * 26 * 26 * 26 * 10000; //number of plates of the form "ABCD-12-34"
+static const size_t SPREAD = 1000003; //prime step which spreads plates over all of them
+static const size_t WALKED = 16; //persons walked by one ListPersons
+
+/**
+ * seeded generator of owners, plates and operations
+ */
+class CGenerator {
+private:
+    mt19937_64 random;
+    size_t owners;
+    double exponent;
+    bool spread;
+    size_t issued = 0;
+
+    /**
+     * @return word of 4 to 9 letters picked by a number, the same number gives the same word
+     */
+    static string Word(uint64_t number, bool capital) {
+        number = number * 0x9e3779b97f4a7c15ULL + 0x632be59bd9b4e019ULL;
+        string word(4 + number % 6, ' ');
+        number /= 6;
+        for (size_t i = 0; i < word.size(); i++, number /= 26) word[i] = (char) ('a' + number % 26);
+        if (capital) word[0] = (char) (word[0] - 'a' + 'A');
+        return word;
+    }
+
+public:
+    CGenerator(uint64_t seed, size_t cars, double exponent, bool spread)
+            : random(seed), owners(max((size_t) 1000, cars / 4)), exponent(exponent), spread(spread) {}
+
+    /**
+     * @return rank of an owner picked by the power law, lower ranks own more cars
+     */
+    size_t Owner() {
+        double u = uniform_real_distribution<double>(0, 1)(random);
+        double x;
+        //inverse of the distribution function of a (continuous) power law over [1, owners]
+        if (fabs(exponent - 1) < 1e-9) x = pow((double) owners, u);
+        else x = pow(1 - u * (1 - pow((double) owners, 1 - exponent)), 1 / (1 - exponent));
+        return min(owners - 1, (size_t) x - 1);
+    }
+
+    /**
+     * @return name of an owner, a few hundred names are shared by all owners
+     */
+    static string Name(size_t owner) { return Word(owner % 300, true); }
+
+    /**
+     * @return surname of an owner, surnames are shared by a few owners
+     */
+    static string Surname(size_t owner) { return Word(owner / 4 + 1000, true); }
+
+    /**
+     * @return plate with the given number, in order of the numbers or spread over all plates
+     */
+    string Plate(size_t number) const {
+        size_t code = spread ? number * SPREAD % PLATES : number;
+        char plate[16];
+        snprintf(plate, sizeof(plate), "%c%c%c%c-%02u-%02u", (char) ('A' + code / 10000 / 17576 % 26),
+                 (char) ('A' + code / 10000 / 676 % 26), (char) ('A' + code / 10000 / 26 % 26),
+                 (char) ('A' + code / 10000 % 26), (unsigned) (code / 100 % 100), (unsigned) (code % 100));
+        return plate;
+    }
+
+    /**
+     * @return number of a plate which was never issued before
+     */
+    size_t Issue() { return issued++; }
+
+    size_t Pick(size_t count) { return random() % count; }
+
+    size_t OwnerCount() const { return owners; }
+};
+
+/**
+ * share of every operation of a mix in percents
+ */
+struct CMix {
+    const char *name;
+    unsigned add, del, transfer, count, list, persons;
+};
+
+static const char *OPERATIONS[] = {"AddCar", "DelCar", "Transfer", "CountCars", "ListCars", "ListPersons"};
+
+/**
+ * @return resident memory of the process in bytes
+ */
+static size_t ResidentMemory() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (!file) return 0;
+    size_t total = 0, resident = 0;
+    if (fscanf(file, "%zu %zu", &total, &resident) != 2) resident = 0;
+    fclose(file);
+    return resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+static double Seconds(chrono::steady_clock::time_point since) {
+    return chrono::duration<double>(chrono::steady_clock::now() - since).count();
+}
+
+/**
+ * runs operations picked by a mix and prints the throughput and latency percentiles of every operation
+ * @param live numbers of plates in the register, kept up to date
+ */
+static void Measure(const CMix &mix, size_t operations, CRegister &reg, CGenerator &generator, vector<size_t> &live) {
+    vector<double> latencies[6];
+    size_t listed = 0;
+    double total = 0;
+    unsigned bounds[] = {mix.add, mix.del, mix.transfer, mix.count, mix.list, mix.persons};
+    for (size_t i = 0; i < operations; i++) {
+        //the operation and its arguments are picked before the clock starts
+        unsigned roll = (unsigned) generator.Pick(100), operation = 0;
+        while (operation < 5 && roll >= bounds[operation]) roll -= bounds[operation++];
+        if (operation <= 2 && live.empty()) operation = 0;
+        size_t victim = live.empty() ? 0 : generator.Pick(live.size());
+        size_t number = operation == 0 ? generator.Issue() : live.empty() ? 0 : live[victim];
+        size_t owner = generator.Owner();
+        string plate = generator.Plate(number), name = CGenerator::Name(owner), surname = CGenerator::Surname(owner);
+
+        auto begin = chrono::steady_clock::now();
+        if (operation == 0) reg.AddCar(plate, name, surname);
+        else if (operation == 1) reg.DelCar(plate);
+        else if (operation == 2) reg.Transfer(plate, name, surname);
+        else if (operation == 3) listed += reg.CountCars(name, surname);
+        else if (operation == 4) {
+            for (CCarList cars = reg.ListCars(name, surname); !cars.AtEnd(); cars.Next()) listed++;
+        } else {
+            CPersonList persons = reg.ListPersons();
+            for (size_t walked = 0; walked < WALKED && !persons.AtEnd(); walked++, persons.Next()) listed++;
+        }
+        double latency = Seconds(begin);
+        total += latency;
+        latencies[operation].push_back(latency * 1e6);
+
+        if (operation == 0) live.push_back(number);
+        else if (operation == 1) {
+            live[victim] = live.back();
+            live.pop_back();
+        }
+    }
+    printf("%-16s %12.0f ops/s   %zu cars, %zu listed\n", mix.name, operations / total, live.size(), listed);
+    for (int operation = 0; operation < 6; operation++) {
+        vector<double> &measured = latencies[operation];
+        if (measured.empty()) continue;
+        sort(measured.begin(), measured.end());
+        printf("  %-14s %12zu ops   p50 %9.2f us   p99 %9.2f us   p99.9 %9.2f us\n", OPERATIONS[operation],
+               measured.size(), measured[measured.size() / 2], measured[measured.size() * 99 / 100],
+               measured[measured.size() * 999 / 1000]);
+    }
+}
+
+int main(int argc, char **argv) {
+    size_t cars = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000000;
+    uint64_t seed = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1;
+    size_t operations = argc > 3 ? strtoull(argv[3], nullptr, 10) : 100000;
+    double exponent = argc > 4 ? strtod(argv[4], nullptr) : 1.2;
+    string plates = argc > 5 ? argv[5] : "random";
+    if (!cars || cars * 2 > PLATES || !operations || exponent < 0 || (plates != "random" && plates != "sequential")) {
+        fprintf(stderr, "usage: %s [cars] [seed] [operations] [exponent] [random|sequential]\n", argv[0]);
+        return 1;
+    }
+    CGenerator generator(seed, cars, exponent, plates == "random");
+    vector<size_t> live;
+    live.reserve(cars + operations);
+    CRegister reg;
+    size_t memory = ResidentMemory();
+
+    //the first cars are added one by one, the rest is applied in batches
+    size_t single = min(cars, max((size_t) 1, cars / 10));
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < single; i++) {
+        size_t owner = generator.Owner(), number = generator.Issue();
+        reg.AddCar(generator.Plate(number), CGenerator::Name(owner), CGenerator::Surname(owner));
+        live.push_back(number);
+    }
+    double added = Seconds(start);
+    vector<CCarOperation> batch;
+    double applied = 0;
+    for (size_t done = single; done < cars; done += batch.size()) {
+        batch.clear();
+        while (batch.size() < BATCH && done + batch.size() < cars) {
+            size_t owner = generator.Owner(), number = generator.Issue();
+            batch.push_back({CCarOperation::ADD_CAR, generator.Plate(number),
+                             CGenerator::Name(owner), CGenerator::Surname(owner)});
+            live.push_back(number);
+        }
+        start = chrono::steady_clock::now();
+        reg.Apply(batch);
+        applied += Seconds(start);
+    }
+    batch = vector<CCarOperation>();
+    memory = ResidentMemory() - memory;
+
+    printf("cars %zu, owners %zu, exponent %.2f, %s plates, seed %llu\n", cars, generator.OwnerCount(), exponent,
+           plates.c_str(), (unsigned long long) seed);
+    printf("%-16s %12.0f cars/s\n", "AddCar", single / added);
+    if (cars > single) printf("%-16s %12.0f cars/s\n", "Apply", (cars - single) / applied);
+    printf("%-16s %12.1f bytes/car\n", "memory", (double) memory / cars);
+
+    //adds and deletes are balanced, so every mix runs on a register of about the same size
+    const CMix mixes[] = {{"read-heavy",     2,  2,  1,  45, 45, 5},
+                          {"write-heavy",    40, 40, 10, 5,  5,  0},
+                          {"transfer-heavy", 5,  5,  70, 10, 10, 0}};
+    for (const CMix &mix: mixes) Measure(mix, operations, reg, generator, live);
+    return 0;
+}
@@ -2,33 +2,382 @@
 #include <string>
 #include <vector>
 #include <cassert>
+#include <cstdint>
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace std;
 #endif /* __PROGTEST__ */
 
 /**
- * structure for storing a single record about a car (ID) and its owner (name, surname).
+ * structure for storing name and surname of a single owner.
+ * Every owner is stored only once and never changes, the register and the lists share him.
  */
-struct CRecord {
+struct COwner {
     string surname;
     string name;
+    uint64_t key; //first 8 characters of the surname, compared before the strings
+
+    COwner(const string &surname, const string &name) : surname(surname), name(name), key(Key(surname)) {}
+
+    bool operator<(const COwner &rhs) const {
+        if (key != rhs.key) return key < rhs.key;
+        if (surname != rhs.surname) return surname < rhs.surname;
+        return name < rhs.name;
+    }
+
+    /**
+     * @return number which orders strings by their first 8 characters the same way as the strings
+     */
+    static uint64_t Key(const string &text) {
+        uint64_t key = 0;
+        for (size_t i = 0; i < 8; i++) key = key << 8 | (i < text.size() ? (unsigned char) text[i] : 0);
+        return key;
+    }
+};
+
+/**
+ * single change of the register applied in a batch, it means the same as the method of the same name
+ */
+struct CCarOperation {
+    enum EType : uint8_t {
+        ADD_CAR = 1, DEL_CAR = 2, TRANSFER = 3
+    };
+
+    EType type;
     string rz;
+    string name; //of the new owner, DEL_CAR does not use it
+    string surname;
+};
 
-    CRecord(const string &surname, const string &name, const string &rz = "") : surname(surname), name(name), rz(rz) {}
+/**
+ * IDs of cars owned by a single person, unsorted
+ */
+typedef vector<string> CCars;
 
-    bool operator==(const CRecord &rhs) const {
-        return (surname == rhs.surname && name == rhs.name && rz == rhs.rz);
+/**
+ * structure for storing an owner in the register and the IDs of his cars, the car IDs are shared with car lists
+ */
+struct CHolder {
+    shared_ptr<const COwner> owner;
+    shared_ptr<CCars> cars;
+};
+
+/**
+ * structure for storing a single record about a car, it refers to the owner and to the car ID in his cars.
+ */
+struct CRecord {
+    uint32_t owner;
+    uint32_t slot; //position of the car ID in the cars of the owner
+};
+
+/**
+ * @return true if nothing but the register refers to a shared object, so it can be changed in place
+ */
+template<typename T>
+bool Unshared(const shared_ptr<T> &object) {
+    if (object.use_count() != 1) return false;
+    //changing the count synchronizes with a list which released the object, its reads happen before the changes
+    shared_ptr<T> count = object;
+    return true;
+}
+
+/**
+ * Open addressing hash table mapping hashes of keys to indexes.
+ * The table only stores the indexes (and hashes of their keys),
+ * the keys themselves are compared by the caller.
+ * Collisions are resolved by linear probing, deleted slots are filled by
+ * shifting the following slots back, so no tombstones are needed.
+ */
+class CHashIndex {
+public:
+    static const size_t NONE = (size_t) -1;
+
+    /**
+     * finds an index
+     * @param hash      hash of the key
+     * @param equal     checks if the key of an index is the wanted one
+     * @return the index or NONE if the key is not in the table
+     */
+    template<typename Equal>
+    size_t Find(size_t hash, Equal equal) const {
+        if (slots.empty()) return NONE;
+        for (size_t i = hash & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1)) {
+            if (slots[i].value == NONE) return NONE;
+            if (slots[i].hash == hash && equal(slots[i].value)) return slots[i].value;
+        }
     }
 
-    bool operator<(const CRecord &rhs) const {
-        if (surname != rhs.surname) return surname < rhs.surname;
-        else if (name != rhs.name) return name < rhs.name;
-        //rz is  not compared here on purpose, it is not required and makes CPersonList easier to implement
-        else return false;
+    /**
+     * adds an index whose key is not in the table yet
+     * @param hash      hash of the key
+     * @param value     the index
+     */
+    void Insert(size_t hash, size_t value) {
+        //the table is kept at most half full, so probe sequences stay short
+        if (2 * (used + 1) > slots.size()) Grow();
+        Place(hash, value);
+        used++;
+    }
+
+    /**
+     * removes an index which is in the table
+     * @param hash      hash of the key
+     * @param value     the index
+     */
+    void Erase(size_t hash, size_t value) {
+        size_t mask = slots.size() - 1;
+        size_t i = hash & mask;
+        while (slots[i].value != value) i = (i + 1) & mask;
+        //shift back every following slot which would not be reachable over the emptied one
+        for (size_t j = (i + 1) & mask; slots[j].value != NONE; j = (j + 1) & mask) {
+            size_t home = slots[j].hash & mask;
+            if (((j - home) & mask) >= ((j - i) & mask)) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i].value = NONE;
+        used--;
+    }
+
+private:
+    struct CSlot {
+        size_t hash;
+        size_t value;
+    };
+
+    vector<CSlot> slots; //size is a power of two
+    size_t used = 0;
+
+    void Place(size_t hash, size_t value) {
+        size_t i = hash & (slots.size() - 1);
+        while (slots[i].value != NONE) i = (i + 1) & (slots.size() - 1);
+        slots[i] = {hash, value};
+    }
+
+    void Grow() {
+        vector<CSlot> old(max((size_t) 16, 2 * slots.size()), {0, NONE});
+        old.swap(slots);
+        for (const CSlot &slot: old) {
+            if (slot.value != NONE) Place(slot.hash, slot.value);
+        }
+    }
+};
+
+/**
+ * Values sorted by Less, split into blocks of at most BLOCK_SIZE values.
+ * Adding or removing a value moves only the rest of its block, blocks are found
+ * by a binary search over their last values.
+ * A version of the order is shared by the lists made from it, the writer changes a version
+ * or a block in place only if no list refers to it, otherwise it changes a copy (copy-on-write).
+ * Blocks are never empty, a position points to an existing value or it is End().
+ */
+template<typename T, typename Less>
+class CBlockOrder {
+public:
+    static const size_t BLOCK_SIZE = 256;
+
+    typedef vector<T> CBlock;
+
+    struct CPosition {
+        size_t block;
+        size_t offset;
+
+        bool operator==(const CPosition &rhs) const { return block == rhs.block && offset == rhs.offset; }
+    };
+
+    /**
+     * blocks of the order at one point in time
+     */
+    struct CVersion {
+        vector<shared_ptr<CBlock>> blocks;
+
+        const T &At(const CPosition &position) const { return (*blocks[position.block])[position.offset]; }
+
+        CPosition Begin() const { return {0, 0}; }
+
+        CPosition End() const { return {blocks.size(), 0}; }
+
+        CPosition Next(CPosition position) const {
+            if (++position.offset == blocks[position.block]->size()) {
+                position.block++;
+                position.offset = 0;
+            }
+            return position;
+        }
+
+        /**
+         * @param before true for a prefix of the values, false for the rest
+         * @return position of the first value for which before is false
+         */
+        template<typename Before>
+        CPosition PartitionPoint(Before before) const {
+            size_t block = partition_point(blocks.begin(), blocks.end(), [&before](const shared_ptr<CBlock> &block) {
+                return before(block->back());
+            }) - blocks.begin();
+            if (block == blocks.size()) return End();
+            const CBlock &found = *blocks[block];
+            return {block, (size_t) (partition_point(found.begin(), found.end(), before) - found.begin())};
+        }
+
+        /**
+         * @return position of the value, or of the next value if it is not in the order
+         */
+        CPosition LowerBound(const T &value) const {
+            return PartitionPoint([&value](const T &other) { return Less()(other, value); });
+        }
+    };
+
+    /**
+     * @return the current version, it does not change until it is released
+     */
+    shared_ptr<const CVersion> Snapshot() const { return current; }
+
+    /**
+     * adds a value which is not in the order yet
+     */
+    void Insert(const T &value) {
+        CVersion &version = Writable();
+        if (version.blocks.empty()) {
+            version.blocks.push_back(make_shared<CBlock>(CBlock{value}));
+            return;
+        }
+        CPosition position = version.LowerBound(value);
+        //a value after all others goes to the end of the last block
+        if (position == version.End()) position = {version.blocks.size() - 1, version.blocks.back()->size()};
+        CBlock &block = WritableBlock(version, position.block);
+        block.insert(block.begin() + position.offset, value);
+        if (block.size() > BLOCK_SIZE) {
+            auto half = make_shared<CBlock>(block.begin() + BLOCK_SIZE / 2, block.end());
+            block.resize(BLOCK_SIZE / 2);
+            version.blocks.insert(version.blocks.begin() + position.block + 1, move(half));
+        }
+    }
+
+    /**
+     * adds a value after all values in the order, used to load values which are already sorted
+     */
+    void Append(const T &value) {
+        CVersion &version = Writable();
+        //loaded blocks are left partly empty, so the first inserts do not split them at once
+        if (version.blocks.empty() || version.blocks.back()->size() >= BLOCK_SIZE * 3 / 4) {
+            version.blocks.push_back(make_shared<CBlock>());
+        }
+        WritableBlock(version, version.blocks.size() - 1).push_back(value);
+    }
+
+    /**
+     * removes a value which is in the order
+     */
+    void Erase(const T &value) {
+        CVersion &version = Writable();
+        CPosition position = version.LowerBound(value);
+        CBlock &block = WritableBlock(version, position.block);
+        block.erase(block.begin() + position.offset);
+        if (block.empty()) {
+            version.blocks.erase(version.blocks.begin() + position.block);
+        } else if (block.size() < BLOCK_SIZE / 4 && position.block + 1 < version.blocks.size()
+                   && block.size() + version.blocks[position.block + 1]->size() <= BLOCK_SIZE) {
+            //small neighbouring blocks are merged, so the number of blocks stays proportional to the values
+            const CBlock &next = *version.blocks[position.block + 1];
+            block.insert(block.end(), next.begin(), next.end());
+            version.blocks.erase(version.blocks.begin() + position.block + 1);
+        }
+    }
+
+    /**
+     * adds and removes many values in one pass over the blocks, blocks without changes stay shared
+     * @param added values sorted by Less which are not in the order yet
+     * @param removed values sorted by Less which are in the order
+     */
+    void Merge(const vector<T> &added, const vector<T> &removed) {
+        if (added.empty() && removed.empty()) return;
+        CVersion &version = Writable();
+        vector<shared_ptr<CBlock>> blocks;
+        CBlock merged; //values of changed blocks, a small rest is carried over to the next block
+        auto add = added.begin(), remove = removed.begin();
+        for (size_t i = 0; i < version.blocks.size(); i++) {
+            const CBlock &block = *version.blocks[i];
+            bool last = i + 1 == version.blocks.size();
+            //a block takes the values up to its last value, the last block takes the rest
+            auto add_end = last ? added.end() : partition_point(add, added.end(), [&block](const T &value) {
+                return Less()(value, block.back());
+            });
+            auto remove_end = last ? removed.end() : partition_point(remove, removed.end(), [&block](const T &value) {
+                return !Less()(block.back(), value);
+            });
+            if (add == add_end && remove == remove_end && merged.empty()) {
+                blocks.push_back(move(version.blocks[i]));
+                continue;
+            }
+            for (const T &value: block) {
+                while (add != add_end && Less()(*add, value)) merged.push_back(*add++);
+                if (remove != remove_end && !Less()(value, *remove)) remove++;
+                else merged.push_back(value);
+            }
+            merged.insert(merged.end(), add, add_end);
+            add = add_end;
+            remove = remove_end;
+            if (merged.size() < BLOCK_SIZE / 4 && !last) continue;
+            Split(blocks, merged);
+            merged.clear();
+        }
+        if (version.blocks.empty()) Split(blocks, added);
+        version.blocks = move(blocks);
+    }
+
+private:
+    shared_ptr<CVersion> current = make_shared<CVersion>();
+
+    /**
+     * appends sorted values as blocks of the same size, loaded like the blocks made by Append()
+     */
+    static void Split(vector<shared_ptr<CBlock>> &blocks, const CBlock &values) {
+        if (values.empty()) return;
+        size_t count = values.size() <= BLOCK_SIZE ? 1 : (values.size() + BLOCK_SIZE * 3 / 4 - 1) / (BLOCK_SIZE * 3 / 4);
+        for (size_t i = 0; i < count; i++) {
+            blocks.push_back(make_shared<CBlock>(values.begin() + values.size() * i / count,
+                                                 values.begin() + values.size() * (i + 1) / count));
+        }
+    }
+
+    CVersion &Writable() {
+        if (!Unshared(current)) current = make_shared<CVersion>(*current);
+        return *current;
+    }
+
+    static CBlock &WritableBlock(CVersion &version, size_t block) {
+        //a block is shared by all versions it was not changed in
+        if (!Unshared(version.blocks[block])) version.blocks[block] = make_shared<CBlock>(*version.blocks[block]);
+        return *version.blocks[block];
     }
 };
 
+struct COwnerLess {
+    bool operator()(const shared_ptr<const COwner> &lhs, const shared_ptr<const COwner> &rhs) const {
+        return *lhs < *rhs;
+    }
+};
+
+//owners sorted primarily by surname and then by name in ascending order
+typedef CBlockOrder<shared_ptr<const COwner>, COwnerLess> COwnerOrder;
+//car IDs sorted in ascending order
+typedef CBlockOrder<string, less<string>> CPlateOrder;
+
 /**
  * Simple forward list, used to store unsorted IDs of
  * cars owned by a single person.
@@ -36,72 +385,110 @@ struct CRecord {
  * to the next car.
  * Instead of copying all of the records, the list referring to
  * records already present in the database
+ * The list keeps the cars it was created with, even if the register changes meanwhile.
  * The list can only advance forward and
  * once the end is reached, it is useless.
  */
 class CCarList {
 public:
-    CCarList(const CRecord *curr, const CRecord *end) : curr(curr), end(end) {}
+    explicit CCarList(shared_ptr<const CCars> cars) : cars(move(cars)), curr(0) {}
 
-    const string &RZ() const { return curr->rz; }
+    const string &RZ() const { return (*cars)[curr]; }
 
-    bool AtEnd() const { return curr == end; }
+    bool AtEnd() const { return !cars || curr == cars->size(); }
 
     void Next() { if (!AtEnd())curr++; }
 
     CCarList &operator=(const CCarList &rhs) {
         if (this == &rhs) return *this;
+        cars = rhs.cars;
         curr = rhs.curr;
-        end = rhs.end;
         return *this;
     }
 
 private:
-    const CRecord *curr;
-    const CRecord *end;
+    shared_ptr<const CCars> cars;
+    size_t curr;
 };
 
 /**
  * Simple forward list, used to store a list of car owners
  * sorted by surname and name in ascending order.
+ * The list keeps the owners it was created with, even if the register changes meanwhile.
  */
 class CPersonList {
 public:
-    CPersonList(const CRecord *curr, const CRecord *end) : curr(curr), end(end) {}
+    explicit CPersonList(shared_ptr<const COwnerOrder::CVersion> order) : order(move(order)), curr({0, 0}) {}
 
-    const string &Name() const { return curr->name; }
+    const string &Name() const { return order->At(curr)->name; }
 
-    const string &Surname() const { return curr->surname; }
+    const string &Surname() const { return order->At(curr)->surname; }
 
-    bool AtEnd() const { return curr == end; }
+    bool AtEnd() const { return curr == order->End(); }
 
-    //the current pointer can't be simply incremented, because the list can contain
-    //multiple cars owned by the same person
-    void Next() { if (!AtEnd()) curr = upper_bound(curr, end, *curr); }
+    void Next() { if (!AtEnd()) curr = order->Next(curr); }
 
     CPersonList &operator=(const CPersonList &rhs) {
         if (this == &rhs) return *this;
+        order = rhs.order;
+        curr = rhs.curr;
+        return *this;
+    }
+
+private:
+    shared_ptr<const COwnerOrder::CVersion> order;
+    COwnerOrder::CPosition curr;
+};
+
+/**
+ * Simple forward list, used to store IDs of cars in a lexicographic range
+ * sorted in ascending order.
+ * The list keeps the cars it was created with, even if the register changes meanwhile.
+ */
+class CPlateList {
+public:
+    CPlateList(shared_ptr<const CPlateOrder::CVersion> order, CPlateOrder::CPosition curr, CPlateOrder::CPosition end)
+            : order(move(order)), curr(curr), end(end) {}
+
+    CPlateList(const CPlateList &src) = default;
+
+    const string &RZ() const { return order->At(curr); }
+
+    bool AtEnd() const { return curr == end; }
+
+    void Next() { if (!AtEnd()) curr = order->Next(curr); }
+
+    CPlateList &operator=(const CPlateList &rhs) {
+        if (this == &rhs) return *this;
+        order = rhs.order;
         curr = rhs.curr;
         end = rhs.end;
         return *this;
     }
 
 private:
-    const CRecord *curr;
-    const CRecord *end;
+    shared_ptr<const CPlateOrder::CVersion> order;
+    CPlateOrder::CPosition curr;
+    CPlateOrder::CPosition end;
 };
 
 /**
  * Main class implementing a register of cars and their owners.
  * Cars can be added, deleted, transferred, listed and counted.
- * Records about cars and their owners are stored in a sorted vector.
+ * Every owner keeps IDs of his cars, sorted blocks keep the owners ordered
+ * and hash tables find cars by their ID and owners by their name.
+ * One thread can change the register while others read it, lists are snapshots which stay valid
+ * and unchanged while the register is changed, the register is locked only to find what to list.
+ * A change is checked and logged while only other changes wait, readers wait only while it is applied.
  */
 class CRegister {
 public:
 
     CRegister() {}
 
-    ~CRegister() {}
+    ~CRegister() {
+        if (wal >= 0) close(wal);
+    }
 
     CRegister(const CRegister &src) = delete;
 
@@ -113,18 +500,18 @@ public:
      * @param name      owner name
      * @param surname   owner surname
      * @return true     if car was added successfully
-     * @return false    if car is already in the register
+     * @return false    if car is already in the register or the log of a durable register could not be written
      */
     bool AddCar(const string &rz, const string &name, const string &surname) {
-        CRecord new_car(surname, name, rz);
-        /* check if the car is in the database.
-           can't use binary_search, vector is not completely sorted */
-        for (CRecord &saved_car: reg) {
-            if (new_car.rz == saved_car.rz) return false;
-        }
-        //add a record to the right position in a sorted vector
-        auto it = lower_bound(reg.begin(), reg.end(), new_car);
-        reg.insert(it, new_car);
+        lock_guard<mutex> change(changing);
+        //check if the car is in the database
+        if (FindCar(rz) != CHashIndex::NONE) return false;
+        if (!Log(ADD_CAR, rz, name, surname)) return false;
+        unique_lock<shared_mutex> writing(lock);
+        size_t record = NewRecord();
+        AddOwner(record, rz, name, surname);
+        plates.Insert(hasher(rz), record);
+        sorted_plates.Insert(rz);
         return true;
     }
 
@@ -132,19 +519,20 @@ public:
      * Method for deleting an existing car from the register
      * @param rz        car ID
      * @return true     if car was deleted successfully
-     * @return false    if car was not found in the register
+     * @return false    if car was not found in the register or the log of a durable register could not be written
      */
     bool DelCar(const string &rz) {
-        //check if the car is in the database
-        for (auto it = reg.begin(); it < reg.end(); ++it) {
-            //remove record if it is
-            if (it->rz == rz) {
-                reg.erase(it);
-                return true;
-            }
-        }
+        lock_guard<mutex> change(changing);
+        size_t record = FindCar(rz);
         //car is not in the database
-        return false;
+        if (record == CHashIndex::NONE) return false;
+        if (!Log(DEL_CAR, rz)) return false;
+        unique_lock<shared_mutex> writing(lock);
+        plates.Erase(hasher(rz), record);
+        sorted_plates.Erase(rz);
+        DelOwner(record);
+        free_records.push_back(record);
+        return true;
     }
 
     /**
@@ -154,23 +542,106 @@ public:
      * @param nName name of new owner
      * @param nSurname surname of new owner
      * @return true if car was transferred successfully
-     * @return false if car is not in the database, or if the former and new owner is the same person
+     * @return false if car is not in the database, or if the former and new owner is the same person,
+     *               or if the log of a durable register could not be written
      */
     bool Transfer(const string &rz, const string &nName, const string &nSurname) {
-        CRecord new_record(nSurname, nName, rz);
-        //check if the car is in the database
-        for (auto it = reg.begin(); it < reg.end(); ++it) {
-            if (it->rz == new_record.rz) {
-                if (*it == new_record) return false; //car can't be transferred to the same person
-                //remove the old record and insert a new one
-                reg.erase(it);
-                auto new_position = lower_bound(reg.begin(), reg.end(), new_record);
-                reg.insert(new_position, new_record);
-                return true;
+        lock_guard<mutex> change(changing);
+        size_t record = FindCar(rz);
+        //car is not in the database, can't transfer
+        if (record == CHashIndex::NONE) return false;
+        const COwner &former = *holders[records[record].owner].owner;
+        if (former.name == nName && former.surname == nSurname) {
+            return false; //car can't be transferred to the same person
+        }
+        if (!Log(TRANSFER, rz, nName, nSurname)) return false;
+        unique_lock<shared_mutex> writing(lock);
+        //move the car ID to the new owner
+        DelOwner(record);
+        AddOwner(record, rz, nName, nSurname);
+        return true;
+    }
+
+    /**
+     * Method for applying many operations at once, as if they were called one by one in their order.
+     * The operations are sorted by car ID, so the result of every operation is decided per car
+     * before anything is changed, and only the final owner of every car is applied.
+     * Added and removed owners and cars are then merged into the sorted blocks in one pass.
+     * Other changes wait for the whole batch, readers wait only while it is applied,
+     * and the batch is logged as a single operation,
+     * so readers and a reloaded register see either all of its changes or none of them.
+     * @param batch operations to apply
+     * @return result of every operation, the same as the method of the same name would return,
+     *         all of them are false if the log of a durable register could not be written
+     */
+    vector<bool> Apply(const vector<CCarOperation> &batch) {
+        //operations on the same car are grouped, the groups are sorted by car ID
+        vector<size_t> order(batch.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        stable_sort(order.begin(), order.end(), [&batch](size_t lhs, size_t rhs) {
+            return batch[lhs].rz < batch[rhs].rz;
+        });
+
+        lock_guard<mutex> change(changing);
+        vector<bool> results(batch.size());
+        vector<CChange> changes;
+        for (size_t group = 0, end; group < order.size(); group = end) {
+            const string &rz = batch[order[group]].rz;
+            size_t record = FindCar(rz);
+            const COwner *former = record == CHashIndex::NONE ? nullptr : holders[records[record].owner].owner.get();
+            //the owner of the car after every operation, nullptr if the car is not in the register
+            const string *name = former ? &former->name : nullptr, *surname = former ? &former->surname : nullptr;
+            for (end = group; end < order.size() && batch[order[end]].rz == rz; end++) {
+                const CCarOperation &operation = batch[order[end]];
+                bool done;
+                if (operation.type == CCarOperation::ADD_CAR) done = !name;
+                else if (operation.type == CCarOperation::DEL_CAR) done = name;
+                else done = name && !(*name == operation.name && *surname == operation.surname);
+                results[order[end]] = done;
+                if (!done) continue;
+                name = operation.type == CCarOperation::DEL_CAR ? nullptr : &operation.name;
+                surname = operation.type == CCarOperation::DEL_CAR ? nullptr : &operation.surname;
             }
+            //a car which ends where it started is not changed at all
+            if (!former && !name) continue;
+            if (former && name && former->name == *name && former->surname == *surname) continue;
+            changes.push_back({&rz, record, name, surname});
         }
-        //car is not in the database, can't transfer
-        return false;
+        if (!LogBatch(batch, results)) return vector<bool>(batch.size(), false);
+        unique_lock<shared_mutex> writing(lock);
+
+        vector<uint32_t> emptied;
+        vector<shared_ptr<const COwner>> added_owners, removed_owners;
+        vector<string> added_plates, removed_plates;
+        //cars leave their owners first, so an owner who gets another car in the batch is kept
+        for (const CChange &change: changes) {
+            if (change.record == CHashIndex::NONE) continue;
+            plates.Erase(hasher(*change.rz), change.record);
+            DelOwner(change.record, &emptied);
+            if (change.name) continue;
+            free_records.push_back(change.record);
+            removed_plates.push_back(*change.rz);
+        }
+        for (CChange &change: changes) {
+            if (!change.name) continue;
+            if (change.record == CHashIndex::NONE) {
+                change.record = NewRecord();
+                added_plates.push_back(*change.rz);
+            }
+            AddOwner(change.record, *change.rz, *change.name, *change.surname, &added_owners);
+            plates.Insert(hasher(*change.rz), change.record);
+        }
+        for (uint32_t owner: emptied) {
+            if (!holders[owner].cars->empty()) continue;
+            removed_owners.push_back(holders[owner].owner);
+            FreeHolder(owner);
+        }
+        sort(added_owners.begin(), added_owners.end(), COwnerLess());
+        sort(removed_owners.begin(), removed_owners.end(), COwnerLess());
+        reg.Merge(added_owners, removed_owners);
+        //the changes are sorted by car ID already
+        sorted_plates.Merge(added_plates, removed_plates);
+        return results;
     }
 
     /**
@@ -180,17 +651,11 @@ public:
      * @return list of cars owned by wanted person
      */
     CCarList ListCars(const string &name, const string &surname) const {
-        CRecord wanted(surname, name);
-        //find the beginning of the list
-        auto begin = lower_bound(reg.begin(), reg.end(), wanted);
-        //find the end of the list
-        auto end = begin;
-        while (end != reg.end()) {
-            if (end->name != wanted.name || end->surname != wanted.surname) break;
-            end++;
-        }
-        //if the person was not found, both begin and end will be equal, and AtEnd must be checked first
-        return CCarList(&(*begin), &(*end));
+        shared_lock<shared_mutex> reading(lock);
+        size_t owner = FindOwner(name, surname);
+        //if the person was not found, the list is empty
+        if (owner == CHashIndex::NONE) return CCarList(nullptr);
+        return CCarList(holders[owner].cars);
     }
 
     /**
@@ -200,14 +665,9 @@ public:
      * @return number of cars owned by a person
      */
     int CountCars(const string &name, const string &surname) const {
-        //create a list of cars and then count the records
-        CCarList list = ListCars(name, surname);
-        int count = 0;
-        while (!list.AtEnd()) {
-            count++;
-            list.Next();
-        }
-        return count;
+        shared_lock<shared_mutex> reading(lock);
+        size_t owner = FindOwner(name, surname);
+        return owner == CHashIndex::NONE ? 0 : (int) holders[owner].cars->size();
     }
 
     /**
@@ -215,14 +675,580 @@ public:
      * @return list of car owners
      */
     CPersonList ListPersons() const {
-        return CPersonList(&(*reg.begin()), &(*reg.end()));
+        shared_lock<shared_mutex> reading(lock);
+        return CPersonList(reg.Snapshot());
+    }
+
+    /**
+     * Method for listing cars whose ID starts with a prefix
+     * @param prefix of car IDs
+     * @return list of the cars sorted by their ID, it costs only as much as the cars it lists
+     */
+    CPlateList ListPlates(const string &prefix) const {
+        shared_lock<shared_mutex> reading(lock);
+        shared_ptr<const CPlateOrder::CVersion> version = sorted_plates.Snapshot();
+        CPlateOrder::CPosition begin = version->LowerBound(prefix);
+        //IDs with the prefix follow each other right after the prefix itself
+        CPlateOrder::CPosition end = version->PartitionPoint([&prefix](const string &rz) {
+            return rz < prefix || rz.compare(0, prefix.size(), prefix) == 0;
+        });
+        return CPlateList(version, begin, end);
+    }
+
+    /**
+     * Method for listing cars whose ID is in a lexicographic range
+     * @param from first car ID of the range
+     * @param to car ID after the range, it is not listed
+     * @return list of the cars sorted by their ID, it costs only as much as the cars it lists
+     */
+    CPlateList ListPlates(const string &from, const string &to) const {
+        shared_lock<shared_mutex> reading(lock);
+        shared_ptr<const CPlateOrder::CVersion> version = sorted_plates.Snapshot();
+        CPlateOrder::CPosition begin = version->LowerBound(from);
+        return CPlateList(version, begin, to <= from ? begin : version->LowerBound(to));
+    }
+
+    /**
+     * Method for making an empty register durable.
+     * The register is loaded from the last snapshot in the directory and the operations
+     * written to the log after it are applied again, every later change is appended to the log.
+     * The snapshot is sorted by owners, so the owners are appended to their order in one pass,
+     * cars are added to the hash index as they are read and their order is sorted once at the end.
+     * @param directory existing directory with the files of the register
+     * @return true if the register was loaded
+     * @return false if the register is not empty or the files could not be read
+     */
+    bool Open(const string &directory) {
+        if (wal >= 0 || !records.empty()) return false;
+        path = directory;
+        uint64_t generation = 0, offset = sizeof(CLogHeader);
+        if (!LoadSnapshot(generation, offset) || !ReplayLog(generation, offset)) {
+            Clear();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Method for writing a snapshot of a durable register and shortening its log.
+     * The snapshot is written from pinned versions of the owners and their cars, readers never wait for it.
+     * Changes wait while the versions are pinned and while the last operations are moved to a new log.
+     * Checkpoints run one at a time, a checkpoint called meanwhile waits for the running one.
+     * @return true if the snapshot was written
+     * @return false if the register is not durable or a file could not be written
+     */
+    bool Checkpoint() {
+        lock_guard<mutex> checkpoint(checkpointing);
+        if (wal < 0) return false;
+        //owners and their cars as they are now, later changes copy them instead of changing them
+        shared_ptr<const COwnerOrder::CVersion> version;
+        vector<shared_ptr<const CCars>> cars;
+        CSnapshotHeader header = {SNAPSHOT_MAGIC, 0, 0, 0};
+        {
+            //only changes modify the register, so readers can go on meanwhile
+            lock_guard<mutex> change(changing);
+            version = reg.Snapshot();
+            for (auto it = version->Begin(); !(it == version->End()); it = version->Next(it)) {
+                const COwner &owner = *version->At(it);
+                cars.push_back(holders[FindOwner(owner.name, owner.surname)].cars);
+            }
+            header.generation = generation;
+            header.offset = logged;
+            header.owners = cars.size();
+        }
+
+        string temporary = SnapshotPath() + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) return false;
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+        size_t i = 0;
+        for (auto it = version->Begin(); written && !(it == version->End()); it = version->Next(it), i++) {
+            const COwner &owner = *version->At(it);
+            uint32_t count = (uint32_t) cars[i]->size();
+            written = WriteString(file, owner.surname) && WriteString(file, owner.name)
+                      && fwrite(&count, sizeof(count), 1, file) == 1;
+            for (const string &rz: *cars[i]) written = written && WriteString(file, rz);
+        }
+        written = fflush(file) == 0 && fsync(fileno(file)) == 0 && written;
+        if (fclose(file) != 0 || !written || rename(temporary.c_str(), SnapshotPath().c_str()) != 0
+            || !SyncDirectory()) {
+            remove(temporary.c_str());
+            return false;
+        }
+
+        //the operations logged meanwhile are moved to a new log of the next generation
+        return StartLog(header.generation + 1, header.offset);
     }
 
 private:
-    /*the vector is sorted primarily by surname and then by name in ascending order.
-      this makes it possible to create CCarList and CPersonList easily just by referencing this vector.
-      On the other hand, searching for rz has to be linear. */
-    vector<CRecord> reg;
+    //records and owners never move, a deleted one is left in place and its index is reused by the next added one
+    vector<CRecord> records;
+    vector<size_t> free_records;
+    vector<CHolder> holders;
+    vector<uint32_t> free_holders;
+    /*owners sorted primarily by surname and then by name in ascending order.
+      this makes it possible to create CPersonList easily just by referencing the blocks. */
+    COwnerOrder reg;
+    CPlateOrder sorted_plates; //the same for CPlateList
+    CHashIndex plates; //car ID -> index of the record
+    CHashIndex names; //name and surname -> index of the owner
+    hash<string> hasher;
+    //taken exclusively by the writer to apply a change and shared by readers, lists are read without it
+    mutable shared_mutex lock;
+    //taken by the writer for a whole change, it guards also the log
+    mutex changing;
+    //files of a durable register
+    string path;
+    int wal = -1; //descriptor of the log opened for appending, -1 if the register is not durable
+    uint64_t logged = 0; //size of the log up to the end of the last operation written completely
+    bool damaged = false; //a failed write could not be cut off the log, nothing is logged until a new log starts
+    uint64_t generation = 0; //generation of the log, a snapshot records the generation and offset it covers
+    mutex checkpointing; //taken by Checkpoint() for its whole run
+
+    enum EOperation : uint8_t {
+        ADD_CAR = CCarOperation::ADD_CAR, DEL_CAR = CCarOperation::DEL_CAR, TRANSFER = CCarOperation::TRANSFER,
+        BATCH = 4 //number of operations followed by the operations, applied only if it was written completely
+    };
+
+    /**
+     * final state of a car changed by a batch
+     */
+    struct CChange {
+        const string *rz;
+        size_t record; //CHashIndex::NONE if the car was not in the register
+        const string *name; //nullptr if the car is deleted
+        const string *surname;
+    };
+
+    static const uint64_t LOG_MAGIC = 0x31474f4c47455243; //"CREGLOG1"
+    static const uint64_t SNAPSHOT_MAGIC = 0x31504e5347455243; //"CREGSNP1"
+
+    struct CLogHeader {
+        uint64_t magic;
+        uint64_t generation;
+    };
+
+    /**
+     * header of a snapshot, followed by the owners sorted by surname and name,
+     * every owner is stored as his surname, name, number of cars and IDs of the cars
+     */
+    struct CSnapshotHeader {
+        uint64_t magic;
+        uint64_t generation; //the snapshot contains all operations of this log generation up to offset
+        uint64_t offset;
+        uint64_t owners;
+    };
+
+    /**
+     * reads values from a mapped file, every read checks the end of the file
+     */
+    struct CReader {
+        const char *position;
+        const char *end;
+
+        template<typename T>
+        bool Read(T &value) {
+            if ((size_t) (end - position) < sizeof(T)) return false;
+            memcpy(&value, position, sizeof(T));
+            position += sizeof(T);
+            return true;
+        }
+
+        bool ReadString(string &text) {
+            uint32_t length;
+            if (!Read(length) || (size_t) (end - position) < length) return false;
+            text.assign(position, length);
+            position += length;
+            return true;
+        }
+    };
+
+    string LogPath() const { return path + "/register.wal"; }
+
+    string SnapshotPath() const { return path + "/register.snap"; }
+
+    static bool WriteString(FILE *file, const string &text) {
+        uint32_t length = (uint32_t) text.size();
+        return fwrite(&length, sizeof(length), 1, file) == 1 && fwrite(text.data(), 1, length, file) == length;
+    }
+
+    static void AppendString(string &record, const string &text) {
+        uint32_t length = (uint32_t) text.size();
+        record.append((const char *) &length, sizeof(length));
+        record.append(text);
+    }
+
+    /**
+     * logs an operation of a durable register before it is applied
+     * @return false if the operation could not be logged, then it must not be applied
+     */
+    bool Log(EOperation operation, const string &rz, const string &name = "", const string &surname = "") {
+        if (wal < 0) return true;
+        string record;
+        AppendOperation(record, operation, rz, name, surname);
+        return Commit(record);
+    }
+
+    /**
+     * logs the successful operations of a batch as one operation before they are applied
+     * @return false if the batch could not be logged, then none of its operations may be applied
+     */
+    bool LogBatch(const vector<CCarOperation> &batch, const vector<bool> &results) {
+        uint32_t count = (uint32_t) std::count(results.begin(), results.end(), true);
+        if (wal < 0 || !count) return true;
+        string record(1, (char) BATCH);
+        record.append((const char *) &count, sizeof(count));
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (results[i]) AppendOperation(record, (EOperation) batch[i].type, batch[i].rz, batch[i].name, batch[i].surname);
+        }
+        return Commit(record);
+    }
+
+    static void AppendOperation(string &record, EOperation operation, const string &rz, const string &name,
+                                const string &surname) {
+        record.push_back((char) operation);
+        AppendString(record, rz);
+        if (operation != DEL_CAR) {
+            AppendString(record, name);
+            AppendString(record, surname);
+        }
+    }
+
+    /**
+     * appends a record to the log and waits until it is on the disk, so a logged operation survives a crash.
+     * A record that was not written completely is cut off the log, the next one would follow a damaged one.
+     * @return false if the record could not be written, the log is left as it was before
+     */
+    bool Commit(const string &record) {
+        if (damaged) return false;
+        bool written = true;
+        for (size_t done = 0; written && done < record.size();) {
+            ssize_t count = write(wal, record.data() + done, record.size() - done);
+            if (count < 0 && errno == EINTR) continue;
+            written = count > 0;
+            if (written) done += count;
+        }
+        if (written && fdatasync(wal) == 0) {
+            logged += record.size();
+            return true;
+        }
+        damaged = ftruncate(wal, (off_t) logged) != 0;
+        return false;
+    }
+
+    /**
+     * makes the renames of the files of a durable register survive a crash
+     */
+    bool SyncDirectory() const {
+        int directory = ::open(path.c_str(), O_RDONLY | O_DIRECTORY);
+        if (directory < 0) return false;
+        bool synced = fsync(directory) == 0;
+        return close(directory) == 0 && synced;
+    }
+
+    /**
+     * maps a whole file
+     * @return false if the file could not be mapped, an empty or missing file is mapped as nullptr
+     */
+    static bool MapFile(const string &file, void *&memory, size_t &size) {
+        memory = nullptr;
+        size = 0;
+        struct stat info;
+        if (stat(file.c_str(), &info) != 0 || !info.st_size) return true;
+        int descriptor = ::open(file.c_str(), O_RDONLY);
+        if (descriptor < 0) return false;
+        size = info.st_size;
+        memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+        close(descriptor);
+        return memory != MAP_FAILED;
+    }
+
+    /**
+     * loads the owners and their cars from the snapshot, they are appended in the stored order
+     * @param generation filled with the log generation the snapshot covers
+     * @param offset filled with the offset in the log the snapshot covers
+     * @return false if the snapshot is damaged
+     */
+    bool LoadSnapshot(uint64_t &generation, uint64_t &offset) {
+        void *memory;
+        size_t size;
+        if (!MapFile(SnapshotPath(), memory, size)) return false;
+        if (!memory) return true; //no snapshot was written yet
+        CReader reader = {(const char *) memory, (const char *) memory + size};
+        CSnapshotHeader header;
+        bool loaded = reader.Read(header) && header.magic == SNAPSHOT_MAGIC;
+        shared_ptr<const COwner> previous;
+        vector<string> loaded_plates;
+        for (uint64_t i = 0; loaded && i < header.owners; i++) {
+            string surname, name;
+            uint32_t count;
+            loaded = reader.ReadString(surname) && reader.ReadString(name) && reader.Read(count) && count;
+            if (!loaded) break;
+            auto owner = make_shared<const COwner>(surname, name);
+            //owners have to be sorted and unique, otherwise the order would be broken
+            loaded = !previous || *previous < *owner;
+            previous = owner;
+            size_t index = holders.size();
+            holders.push_back({owner, make_shared<CCars>()});
+            holders.back().cars->reserve(count);
+            names.Insert(OwnerHash(name, surname), index);
+            reg.Append(owner);
+            for (uint32_t slot = 0; loaded && slot < count; slot++) {
+                string rz;
+                loaded = reader.ReadString(rz) && FindCar(rz) == CHashIndex::NONE;
+                if (!loaded) break;
+                holders.back().cars->push_back(rz);
+                loaded_plates.push_back(rz);
+                records.push_back({(uint32_t) index, slot});
+                plates.Insert(hasher(rz), records.size() - 1);
+            }
+        }
+        loaded = loaded && reader.position == reader.end;
+        //cars are stored by their owners, so the plate order is sorted once at the end
+        sort(loaded_plates.begin(), loaded_plates.end());
+        for (const string &rz: loaded_plates) sorted_plates.Append(rz);
+        generation = header.generation;
+        offset = header.offset;
+        munmap(memory, size);
+        return loaded;
+    }
+
+    /**
+     * applies operations logged after the snapshot and opens the log for appending
+     * @param covered generation of the log covered by the snapshot
+     * @param offset in the log of that generation where the snapshot ends
+     * @return false if the log is damaged or does not follow the snapshot
+     */
+    bool ReplayLog(uint64_t covered, uint64_t offset) {
+        void *memory;
+        size_t size;
+        if (!MapFile(LogPath(), memory, size)) return false;
+        if (!memory) return StartLog(covered + 1, 0); //a new log
+        CReader reader = {(const char *) memory, (const char *) memory + size};
+        CLogHeader header;
+        bool replayed = reader.Read(header) && header.magic == LOG_MAGIC;
+        //a crash can happen after a snapshot was written, but before the log was shortened
+        if (replayed && header.generation == covered) {
+            replayed = offset <= size;
+            reader.position = (const char *) memory + min(offset, (uint64_t) size);
+        } else replayed = replayed && header.generation == covered + 1;
+        const char *applied = reader.position;
+        while (replayed && reader.position != reader.end) {
+            //an operation which was not written completely is dropped
+            uint8_t operation;
+            if (!reader.Read(operation)) break;
+            if (operation == BATCH) {
+                uint32_t count;
+                if (!reader.Read(count)) break;
+                vector<CCarOperation> batch;
+                bool complete = true;
+                for (uint32_t i = 0; replayed && complete && i < count; i++) {
+                    batch.emplace_back();
+                    complete = reader.Read(operation) && (replayed = operation >= ADD_CAR && operation <= TRANSFER)
+                               && ReadOperation(reader, operation, batch.back());
+                }
+                if (!complete) break;
+                if (replayed) Apply(batch);
+            } else {
+                CCarOperation single;
+                if (!ReadOperation(reader, operation, single)) break;
+                if (operation == DEL_CAR) DelCar(single.rz);
+                else if (operation == ADD_CAR) AddCar(single.rz, single.name, single.surname);
+                else if (operation == TRANSFER) Transfer(single.rz, single.name, single.surname);
+                else replayed = false;
+            }
+            applied = reader.position;
+        }
+        size_t complete = applied - (const char *) memory;
+        munmap(memory, size);
+        if (!replayed) return false;
+        generation = header.generation;
+        if (truncate(LogPath().c_str(), complete) != 0) return false;
+        wal = ::open(LogPath().c_str(), O_WRONLY | O_APPEND);
+        logged = complete;
+        return wal >= 0;
+    }
+
+    /**
+     * reads a car ID and the new owner of a logged operation
+     * @return false if the operation was not written completely
+     */
+    static bool ReadOperation(CReader &reader, uint8_t type, CCarOperation &operation) {
+        operation.type = (CCarOperation::EType) type;
+        if (!reader.ReadString(operation.rz)) return false;
+        return type == DEL_CAR || (reader.ReadString(operation.name) && reader.ReadString(operation.surname));
+    }
+
+    /**
+     * replaces the log with a new one, the operations logged after offset are copied to it.
+     * The operations logged so far are copied and synced while changes go on, changes wait only
+     * while the operations logged meanwhile are copied and the new log replaces the current one.
+     * @param next generation of the new log
+     * @param offset in the current log, ignored if there is none
+     * @return false if the new log could not be written
+     */
+    bool StartLog(uint64_t next, uint64_t offset) {
+        string temporary = LogPath() + ".tmp";
+        FILE *file = fopen(temporary.c_str(), "wb");
+        if (!file) return false;
+        CLogHeader header = {LOG_MAGIC, next};
+        bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+        int old = wal >= 0 ? ::open(LogPath().c_str(), O_RDONLY) : -1;
+        written = written && (wal < 0 || old >= 0);
+        uint64_t copied = offset, end = offset;
+        if (old >= 0) {
+            {
+                lock_guard<mutex> change(changing);
+                end = logged;
+            }
+            written = written && CopyLog(old, file, copied, end) && fflush(file) == 0 && fsync(fileno(file)) == 0;
+        }
+        lock_guard<mutex> change(changing);
+        //only complete operations are copied, a damaged end of the log is left behind
+        if (old >= 0) written = written && CopyLog(old, file, copied, logged);
+        written = fflush(file) == 0 && fsync(fileno(file)) == 0 && written;
+        if (old >= 0) close(old);
+        if (fclose(file) != 0 || !written || rename(temporary.c_str(), LogPath().c_str()) != 0 || !SyncDirectory()) {
+            remove(temporary.c_str());
+            return false;
+        }
+        if (wal >= 0) close(wal);
+        wal = ::open(LogPath().c_str(), O_WRONLY | O_APPEND);
+        logged = sizeof(header) + copied - offset;
+        damaged = false;
+        generation = next;
+        return wal >= 0;
+    }
+
+    /**
+     * appends a part of the current log to a new log, the current log is read by offsets,
+     * so nothing beyond the part is buffered while the log is appended to
+     * @param copied start of the part, moved to its end
+     * @param end end of the part
+     */
+    static bool CopyLog(int from, FILE *to, uint64_t &copied, uint64_t end) {
+        char buffer[1 << 16];
+        while (copied < end) {
+            ssize_t count = pread(from, buffer, (size_t) min((uint64_t) sizeof(buffer), end - copied), (off_t) copied);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0 || fwrite(buffer, 1, count, to) != (size_t) count) return false;
+            copied += count;
+        }
+        return true;
+    }
+
+    /**
+     * empties the register after a failed Open()
+     */
+    void Clear() {
+        if (wal >= 0) close(wal);
+        wal = -1;
+        logged = 0;
+        damaged = false;
+        records.clear();
+        free_records.clear();
+        holders.clear();
+        free_holders.clear();
+        reg = COwnerOrder();
+        sorted_plates = CPlateOrder();
+        plates = CHashIndex();
+        names = CHashIndex();
+        generation = 0;
+    }
+
+    const string &Plate(size_t record) const {
+        return (*holders[records[record].owner].cars)[records[record].slot];
+    }
+
+    size_t FindCar(const string &rz) const {
+        return plates.Find(hasher(rz), [this, &rz](size_t record) { return Plate(record) == rz; });
+    }
+
+    size_t OwnerHash(const string &name, const string &surname) const {
+        return hasher(surname) * 31 + hasher(name);
+    }
+
+    size_t FindOwner(const string &name, const string &surname) const {
+        return names.Find(OwnerHash(name, surname), [this, &name, &surname](size_t owner) {
+            return holders[owner].owner->name == name && holders[owner].owner->surname == surname;
+        });
+    }
+
+    /**
+     * @return the cars of an owner, copied first if a list refers to them
+     */
+    CCars &WritableCars(CHolder &holder) {
+        if (!Unshared(holder.cars)) holder.cars = make_shared<CCars>(*holder.cars);
+        return *holder.cars;
+    }
+
+    /**
+     * gives a car to an owner, an owner who is not in the register yet is added
+     * @param record index of the record of the car
+     * @param added_owners collects new owners instead of adding them to the order, if it is set
+     */
+    void AddOwner(size_t record, const string &rz, const string &name, const string &surname,
+                  vector<shared_ptr<const COwner>> *added_owners = nullptr) {
+        size_t owner = FindOwner(name, surname);
+        if (owner == CHashIndex::NONE) {
+            CHolder added = {make_shared<const COwner>(surname, name), make_shared<CCars>()};
+            if (free_holders.empty()) {
+                owner = holders.size();
+                holders.push_back(added);
+            } else {
+                owner = free_holders.back();
+                free_holders.pop_back();
+                holders[owner] = added;
+            }
+            names.Insert(OwnerHash(name, surname), owner);
+            if (added_owners) added_owners->push_back(added.owner);
+            else reg.Insert(added.owner);
+        }
+        CCars &cars = WritableCars(holders[owner]);
+        records[record] = {(uint32_t) owner, (uint32_t) cars.size()};
+        cars.push_back(rz);
+    }
+
+    /**
+     * takes a car from its owner, an owner without cars is removed
+     * @param record index of the record of the car
+     * @param emptied collects owners without cars instead of removing them, if it is set
+     */
+    void DelOwner(size_t record, vector<uint32_t> *emptied = nullptr) {
+        uint32_t owner = records[record].owner;
+        CHolder &found = holders[owner];
+        CCars &cars = WritableCars(found);
+        //the last car of the owner takes the place of the removed one
+        if (records[record].slot + 1 != cars.size()) {
+            size_t moved = FindCar(cars.back());
+            records[moved].slot = records[record].slot;
+            cars[records[record].slot] = move(cars.back());
+        }
+        cars.pop_back();
+        if (!cars.empty()) return;
+        if (emptied) {
+            emptied->push_back(owner);
+            return;
+        }
+        reg.Erase(found.owner);
+        FreeHolder(owner);
+    }
+
+    void FreeHolder(uint32_t owner) {
+        names.Erase(OwnerHash(holders[owner].owner->name, holders[owner].owner->surname), owner);
+        holders[owner] = CHolder();
+        free_holders.push_back(owner);
+    }
+
+    size_t NewRecord() {
+        if (free_records.empty()) {
+            records.push_back({0, 0});
+            return records.size() - 1;
+        }
+        size_t index = free_records.back();
+        free_records.pop_back();
+        return index;
+    }
 };
 
 #ifndef __PROGTEST__
@@ -240,6 +1266,13 @@ bool checkPerson(CRegister &r,
     return result.size() == 0;
 }
 
+static bool checkPlates(CPlateList l, const vector<string> &r) {
+    vector<string> result;
+    for ( ; ! l . AtEnd (); l . Next () )
+        result . push_back ( l . RZ () );
+    return result == r;
+}
+
 /**
  * driver code for testing
  */
@@ -300,6 +1333,180 @@ int main() {
     assert ( checkPerson ( b2, "Peter", "Smith", { "XYZ-11-22" } ) );
     i2 . Next ();
     assert ( i2 . AtEnd () );
+    assert ( b2 . DelCar ( "ABC-32-22" ) == true );
+    assert ( b2 . DelCar ( "ABC-32-22" ) == false );
+    assert ( b2 . CountCars ( "John", "Hacker" ) == 0 );
+    assert ( b2 . AddCar ( "ABC-32-22", "Jane", "Black" ) == true );
+    assert ( checkPerson ( b2, "Jane", "Black", { "ABC-32-22" } ) );
+
+    CRegister b3;
+    assert ( b3 . AddCar ( "ABC-12-34", "John", "Smith" ) == true );
+    CCarList l3 = b3 . ListCars ( "John", "Smith" );
+    CPersonList i3 = b3 . ListPersons ();
+    assert ( b3 . AddCar ( "XYZ-11-22", "John", "Smith" ) == true );
+    assert ( b3 . AddCar ( "ABC-32-22", "John", "Hacker" ) == true );
+    assert ( b3 . Transfer ( "ABC-12-34", "Jane", "Black" ) == true );
+    //lists keep showing the register as it was when they were created
+    assert ( ! l3 . AtEnd () && l3 . RZ () == "ABC-12-34" );
+    l3 . Next ();
+    assert ( l3 . AtEnd () );
+    assert ( ! i3 . AtEnd () && i3 . Surname () == "Smith" && i3 . Name () == "John" );
+    i3 . Next ();
+    assert ( i3 . AtEnd () );
+    assert ( checkPerson ( b3, "John", "Smith", { "XYZ-11-22" } ) );
+    CPlateList p3 = b3 . ListPlates ( "ABC" );
+    assert ( checkPlates ( b3 . ListPlates ( "ABC-" ), { "ABC-12-34", "ABC-32-22" } ) );
+    assert ( checkPlates ( b3 . ListPlates ( "" ), { "ABC-12-34", "ABC-32-22", "XYZ-11-22" } ) );
+    assert ( checkPlates ( b3 . ListPlates ( "XYZ-11-22" ), { "XYZ-11-22" } ) );
+    assert ( checkPlates ( b3 . ListPlates ( "ABD" ), {  } ) );
+    assert ( checkPlates ( b3 . ListPlates ( "ABC-2", "XYZ" ), { "ABC-32-22" } ) );
+    assert ( checkPlates ( b3 . ListPlates ( "ABC-12-34", "XYZ-11-22" ), { "ABC-12-34", "ABC-32-22" } ) );
+    assert ( checkPlates ( b3 . ListPlates ( "XYZ", "ABC" ), {  } ) );
+    assert ( b3 . DelCar ( "ABC-12-34" ) == true );
+    assert ( checkPlates ( b3 . ListPlates ( "ABC" ), { "ABC-32-22" } ) );
+    assert ( checkPlates ( p3, { "ABC-12-34", "ABC-32-22" } ) );
+
+    CRegister b7;
+    assert ( b7 . AddCar ( "ABC-12-34", "John", "Smith" ) == true );
+    CPersonList i7 = b7 . ListPersons ();
+    vector<bool> r7 = b7 . Apply ( { { CCarOperation::ADD_CAR, "XYZ-11-22", "Jane", "Black" },
+                                     { CCarOperation::ADD_CAR, "XYZ-11-22", "John", "Hacker" },
+                                     { CCarOperation::TRANSFER, "ABC-12-34", "John", "Smith" },
+                                     { CCarOperation::TRANSFER, "ABC-12-34", "John", "Hacker" },
+                                     { CCarOperation::DEL_CAR, "XYZ-11-22", "", "" },
+                                     { CCarOperation::DEL_CAR, "XYZ-11-22", "", "" },
+                                     { CCarOperation::TRANSFER, "XYZ-11-22", "John", "Smith" },
+                                     { CCarOperation::ADD_CAR, "XYZ-99-88", "Peter", "Smith" } } );
+    assert ( r7 == vector<bool> ( { true, false, false, true, true, false, false, true } ) );
+    assert ( checkPerson ( b7, "John", "Hacker", { "ABC-12-34" } ) );
+    assert ( b7 . CountCars ( "John", "Smith" ) == 0 );
+    assert ( b7 . CountCars ( "Jane", "Black" ) == 0 );
+    assert ( checkPerson ( b7, "Peter", "Smith", { "XYZ-99-88" } ) );
+    assert ( checkPlates ( b7 . ListPlates ( "" ), { "ABC-12-34", "XYZ-99-88" } ) );
+    CPersonList j7 = b7 . ListPersons ();
+    assert ( ! j7 . AtEnd () && j7 . Surname () == "Hacker" && j7 . Name () == "John" );
+    j7 . Next ();
+    assert ( ! j7 . AtEnd () && j7 . Surname () == "Smith" && j7 . Name () == "Peter" );
+    j7 . Next ();
+    assert ( j7 . AtEnd () );
+    //lists made before the batch do not see any of its changes
+    assert ( ! i7 . AtEnd () && i7 . Surname () == "Smith" && i7 . Name () == "John" );
+    i7 . Next ();
+    assert ( i7 . AtEnd () );
+
+    char directory[] = "/tmp/registr-XXXXXX";
+    assert ( mkdtemp ( directory ) );
+    {
+        CRegister b4;
+        assert ( b4 . Open ( directory ) == true );
+        assert ( b4 . AddCar ( "ABC-12-34", "John", "Smith" ) == true );
+        assert ( b4 . AddCar ( "ABC-32-22", "John", "Hacker" ) == true );
+        assert ( b4 . Checkpoint () == true );
+        assert ( b4 . Transfer ( "ABC-12-34", "Jane", "Black" ) == true );
+        assert ( b4 . AddCar ( "XYZ-11-22", "John", "Hacker" ) == true );
+    }
+    {
+        CRegister b5;
+        assert ( b5 . Open ( directory ) == true );
+        assert ( b5 . Open ( directory ) == false );
+        assert ( checkPerson ( b5, "Jane", "Black", { "ABC-12-34" } ) );
+        assert ( checkPerson ( b5, "John", "Hacker", { "ABC-32-22", "XYZ-11-22" } ) );
+        assert ( b5 . CountCars ( "John", "Smith" ) == 0 );
+        assert ( b5 . DelCar ( "ABC-32-22" ) == true );
+        assert ( b5 . Apply ( { { CCarOperation::ADD_CAR, "ABC-99-99", "John", "Hacker" },
+                                { CCarOperation::TRANSFER, "ABC-12-34", "John", "Smith" } } ) == vector<bool> ( 2, true ) );
+    }
+    {
+        CRegister b6;
+        assert ( b6 . Open ( directory ) == true );
+        assert ( checkPerson ( b6, "John", "Hacker", { "XYZ-11-22", "ABC-99-99" } ) );
+        assert ( checkPerson ( b6, "John", "Smith", { "ABC-12-34" } ) );
+        assert ( checkPlates ( b6 . ListPlates ( "" ), { "ABC-12-34", "ABC-99-99", "XYZ-11-22" } ) );
+    }
+    {
+        CRegister b8;
+        assert ( b8 . Open ( directory ) == true );
+        //checkpoints called at once run one after another
+        thread other ( [&b8] () { for ( int i = 0; i < 10; i ++ ) assert ( b8 . Checkpoint () == true ); } );
+        for ( int i = 0; i < 10; i ++ ) assert ( b8 . Checkpoint () == true );
+        other . join ();
+        assert ( b8 . AddCar ( "XYZ-55-66", "Jane", "Black" ) == true );
+    }
+    {
+        CRegister b9;
+        assert ( b9 . Open ( directory ) == true );
+        assert ( checkPerson ( b9, "Jane", "Black", { "XYZ-55-66" } ) );
+        assert ( b9 . CountCars ( "John", "Hacker" ) == 2 );
+    }
+    assert ( remove ( ( string ( directory ) + "/register.snap" ) . c_str () ) == 0 );
+    assert ( remove ( ( string ( directory ) + "/register.wal" ) . c_str () ) == 0 );
+    assert ( rmdir ( directory ) == 0 );
+
+    //readers list the register while one writer changes it, every list has to be a consistent snapshot:
+    //pairs of cars are added, transferred and deleted by batches, so a list never has just one car of a pair
+    CRegister b10;
+    atomic<bool> writing ( true );
+    thread writer ( [&b10, &writing] () {
+        auto owner = [] ( int k ) { return "Owner" + to_string ( k % 5 ); };
+        auto pair = [] ( CCarOperation::EType type, int k, const string & surname ) {
+            string rz = "PA-" + to_string ( k ) + "-";
+            return vector<CCarOperation> { { type, rz + "A", "Pair", surname }, { type, rz + "B", "Pair", surname } };
+        };
+        for ( int i = 0; i < 2000; i ++ )
+        {
+            assert ( b10 . Apply ( pair ( CCarOperation::ADD_CAR, i, owner ( i ) ) ) == vector<bool> ( 2, true ) );
+            if ( i >= 1 ) assert ( b10 . Apply ( pair ( CCarOperation::TRANSFER, i - 1, owner ( i ) ) ) == vector<bool> ( 2, true ) );
+            if ( i % 3 == 0 && i >= 30 ) assert ( b10 . Apply ( pair ( CCarOperation::DEL_CAR, i - 30, "" ) ) == vector<bool> ( 2, true ) );
+            assert ( b10 . AddCar ( "SG-" + to_string ( i ), "Single", owner ( i ) ) );
+            if ( i >= 1 ) assert ( b10 . Transfer ( "SG-" + to_string ( i - 1 ), "Single", owner ( i + 1 ) ) );
+            if ( i >= 2 ) assert ( b10 . DelCar ( "SG-" + to_string ( i - 2 ) ) );
+        }
+        writing = false;
+    } );
+    vector<thread> readers;
+    for ( int r = 0; r < 3; r ++ )
+        readers . emplace_back ( [&b10, &writing] () {
+            do
+            {
+                string surname, name;
+                for ( CPersonList l = b10 . ListPersons (); ! l . AtEnd (); l . Next () )
+                {
+                    assert ( make_pair ( surname, name ) < make_pair ( l . Surname (), l . Name () ) );
+                    surname = l . Surname ();
+                    name = l . Name ();
+                }
+                size_t listed = 0;
+                string previous;
+                for ( CPlateList l = b10 . ListPlates ( "PA-" ); ! l . AtEnd (); l . Next (), listed ++ )
+                {
+                    //the second car of a pair follows the first one right away
+                    assert ( l . RZ () . compare ( 0, 3, "PA-" ) == 0 && previous < l . RZ () );
+                    assert ( listed % 2 ? l . RZ () == previous . substr ( 0, previous . size () - 1 ) + "B" : l . RZ () . back () == 'A' );
+                    previous = l . RZ ();
+                }
+                assert ( listed % 2 == 0 );
+                for ( int k = 0; k < 5; k ++ )
+                {
+                    vector<string> cars;
+                    for ( CCarList l = b10 . ListCars ( "Pair", "Owner" + to_string ( k ) ); ! l . AtEnd (); l . Next () )
+                        cars . push_back ( l . RZ () );
+                    sort ( cars . begin (), cars . end () );
+                    assert ( adjacent_find ( cars . begin (), cars . end () ) == cars . end () );
+                    for ( const string & rz : cars )
+                        assert ( binary_search ( cars . begin (), cars . end (), rz . substr ( 0, rz . size () - 1 ) + ( rz . back () == 'A' ? "B" : "A" ) ) );
+                    assert ( b10 . CountCars ( "Single", "Owner" + to_string ( k ) ) <= 3 );
+                }
+                previous . clear ();
+                for ( CPlateList l = b10 . ListPlates ( "SG-", "SG-~" ); ! l . AtEnd (); l . Next () )
+                {
+                    assert ( previous < l . RZ () );
+                    previous = l . RZ ();
+                }
+            } while ( writing );
+        } );
+    writer . join ();
+    for ( thread & reader : readers ) reader . join ();
+    assert ( b10 . CountCars ( "Single", "Owner4" ) == 1 && b10 . CountCars ( "Single", "Owner0" ) == 1 );
     return 0;
 }
 